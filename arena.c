@@ -0,0 +1,69 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+#define ALIGN 16
+
+bool
+arena_init(Arena *arena, size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	arena->size = (size + page - 1) / page * page;
+	arena->used = 0;
+	arena->base = mmap(NULL, arena->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (arena->base == MAP_FAILED) {
+		fprintf(stderr, "Cannot map arena: %s\n", strerror(errno));
+		arena->base = NULL;
+		return false;
+	}
+	return true;
+}
+
+void *
+arena_alloc(Arena *arena, size_t size)
+{
+	void *ptr;
+
+	size = (size + ALIGN - 1) & ~(size_t) (ALIGN - 1);
+	if (size > arena->size - arena->used) {
+		fprintf(stderr, "Arena of %zu bytes exhausted.\n", arena->size);
+		return NULL;
+	}
+	ptr = arena->base + arena->used;
+	arena->used += size;
+	return ptr;
+}
+
+void
+arena_reset(Arena *arena)
+{
+	/* Private anonymous pages read as zeroes again after this. */
+	if (arena->used > 0) {
+		madvise(arena->base, arena->size, MADV_DONTNEED);
+	}
+	arena->used = 0;
+}
+
+void
+arena_destroy(Arena *arena)
+{
+	if (arena->base != NULL) {
+		munmap(arena->base, arena->size);
+		arena->base = NULL;
+	}
+}
@@ -0,0 +1,37 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Arena: a fixed-size region of memory that allocations are taken from by
+ * bumping an offset, and that is given back in one step.
+ *
+ * The region is mapped once and never grows, so memory that comes and goes
+ * with a connection cannot fragment the heap. arena_reset() frees all
+ * allocations at once and returns the pages to the kernel; the next
+ * allocations get zeroed pages again.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Embedded by its owner, set up with arena_init(). */
+typedef struct Arena {
+	uint8_t *base;
+	size_t size;
+	size_t used;
+} Arena;
+
+/* Map size bytes, rounded up to whole pages. Returns false on failure. */
+bool arena_init(Arena *arena, size_t size);
+/* Zeroed memory aligned for any type, NULL once the arena is full. */
+void *arena_alloc(Arena *arena, size_t size);
+/* Free all allocations. */
+void arena_reset(Arena *arena);
+void arena_destroy(Arena *arena);
+
+#endif /* ARENA_H */
@@ -0,0 +1,270 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* classify - microbenchmark of the per-event work of the wxkbd engine, without
+ * an X server.
+ *
+ * A buffer of synthetic events, laid out as xcb returns them, is run through
+ * the classification of hierarchy events, the iteration over their device
+ * infos and the dispatch in wxkbd_handle_event(). Out of every 8 events, one is
+ * a core event, one another XInput event, one an XKB StateNotify, four are
+ * hierarchy events that need no apply (removals, attachments, enabling and
+ * disabling) and one adds a slave keyboard. Events that add a keyboard are
+ * classified but not dispatched, as applying the settings needs a server.
+ *
+ * libwxkbd.c is compiled into this file to reach its static functions.
+ * Allocations are counted by wrapping malloc, calloc and realloc at link time.
+ * Prints ns/event and allocations/event of each pass as JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "libwxkbd.c"
+
+#define XI_MAJOR 131
+#define XKB_FIRST_EVENT 85
+#define PATTERN 8
+
+typedef struct Pass {
+	const char *name;
+	unsigned long events;
+	uint64_t ns;
+	unsigned long allocations;
+} Pass;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+
+static unsigned long allocations;
+
+static uint64_t now_ns(void);
+static size_t event_size(unsigned int i, unsigned int devices);
+static void make_event(uint8_t *buf, unsigned int i, unsigned int devices);
+static void count_device(const WxkbdDevice *device, void *data);
+static void print_pass(const Pass *pass, const char *sep);
+static void die(const char *fmt, ...);
+
+void *
+__wrap_malloc(size_t size)
+{
+	allocations++;
+	return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocations++;
+	return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t
+event_size(unsigned int i, unsigned int devices)
+{
+	switch (i % PATTERN) {
+	case 0:
+	case 2:
+		return sizeof(xcb_generic_event_t);
+	case 1:
+		return sizeof(xcb_ge_generic_event_t);
+	default:
+		return sizeof(xcb_input_hierarchy_event_t) + devices * sizeof(xcb_input_hierarchy_info_t);
+	}
+}
+
+/* Like the server, hierarchy events list all devices, only the first one
+ * changed. */
+static void
+make_event(uint8_t *buf, unsigned int i, unsigned int devices)
+{
+	static const uint32_t flags[] = {
+		XCB_INPUT_HIERARCHY_MASK_SLAVE_REMOVED,
+		XCB_INPUT_HIERARCHY_MASK_SLAVE_ATTACHED,
+		XCB_INPUT_HIERARCHY_MASK_DEVICE_ENABLED,
+		XCB_INPUT_HIERARCHY_MASK_DEVICE_DISABLED,
+		XCB_INPUT_HIERARCHY_MASK_SLAVE_ADDED | XCB_INPUT_HIERARCHY_MASK_DEVICE_ENABLED,
+	};
+	xcb_generic_event_t *event = (xcb_generic_event_t *) buf;
+	xcb_ge_generic_event_t *generic_event = (xcb_ge_generic_event_t *) buf;
+	xcb_input_hierarchy_event_t *hierarchy_event = (xcb_input_hierarchy_event_t *) buf;
+	xcb_input_hierarchy_info_t *info = (xcb_input_hierarchy_info_t *) (hierarchy_event + 1);
+	unsigned int j;
+
+	memset(buf, 0, event_size(i, devices));
+	event->sequence = event->full_sequence = i;
+	switch (i % PATTERN) {
+	case 0:
+		event->response_type = XCB_KEY_PRESS;
+		return;
+	case 1:
+		generic_event->response_type = XCB_GE_GENERIC;
+		generic_event->extension = XI_MAJOR;
+		generic_event->event_type = XCB_INPUT_DEVICE_CHANGED;
+		return;
+	case 2:
+		event->response_type = XKB_FIRST_EVENT;
+		event->pad0 = XCB_XKB_STATE_NOTIFY;     /* xkbType */
+		return;
+	}
+
+	hierarchy_event->response_type = XCB_GE_GENERIC;
+	hierarchy_event->extension = XI_MAJOR;
+	hierarchy_event->length = devices * sizeof(*info) / 4;
+	hierarchy_event->event_type = XCB_INPUT_HIERARCHY;
+	hierarchy_event->time = i;
+	hierarchy_event->flags = flags[i % PATTERN - 3];
+	hierarchy_event->num_infos = devices;
+	for (j = 0; j < devices; j++) {
+		info[j].deviceid = 2 + j;
+		info[j].attachment = (j < 2) ? 3 - j : 2 + j % 2;
+		info[j].type = (j < 2) ? XCB_INPUT_DEVICE_TYPE_MASTER_POINTER + j : XCB_INPUT_DEVICE_TYPE_SLAVE_POINTER + j % 2;
+		info[j].enabled = 1;
+	}
+	info[0].flags = hierarchy_event->flags;
+}
+
+static void
+count_device(const WxkbdDevice *device, void *data)
+{
+	*(unsigned long *) data += device->flags != 0;
+}
+
+static void
+print_pass(const Pass *pass, const char *sep)
+{
+	printf("\"%s\":{\"events\":%lu,\"ns_per_event\":%.2f,\"allocations_per_event\":%.3f}%s",
+	       pass->name, pass->events, (double) pass->ns / pass->events,
+	       (double) pass->allocations / pass->events, sep);
+}
+
+static void
+die(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+	long count = 100000, devices = 16, rounds = 20;
+	unsigned long reported = 0, adds = 0, round, i;
+	uint8_t *buf;
+	xcb_generic_event_t **events;
+	size_t size = 0;
+	uint64_t start;
+	xcb_query_extension_reply_t xinput_query = { .present = 1, .major_opcode = XI_MAJOR };
+	xcb_query_extension_reply_t xkb_query = { .present = 1, .first_event = XKB_FIRST_EVENT };
+	Wxkbd wxkbd = { .xinput_query = &xinput_query, .xkb_query = &xkb_query, .device_func = count_device, .device_data = &reported };
+	Pass classify = { .name = "classify" }, iterate = { .name = "iterate" }, dispatch = { .name = "dispatch" };
+
+	while ((opt = getopt(argc, argv, "n:d:r:")) != -1) {
+		switch (opt) {
+		case 'n': count = atol(optarg); break;
+		case 'd': devices = atol(optarg); break;
+		case 'r': rounds = atol(optarg); break;
+		default:
+			die("Usage: %s [-n events] [-d devices per hierarchy event] [-r rounds]\n", argv[0]);
+		}
+	}
+	if (count < PATTERN || devices < 2 || devices > 1024 || rounds < 1) {
+		die("Invalid arguments.\n");
+	}
+
+	/* One contiguous buffer, so that the passes are not dominated by cache
+	 * misses on scattered events. */
+	for (i = 0; i < (unsigned long) count; i++) {
+		size += event_size(i, devices);
+	}
+	if ((buf = malloc(size)) == NULL || (events = calloc(count, sizeof(*events))) == NULL) {
+		die("Cannot allocate memory.\n");
+	}
+	for (i = 0, size = 0; i < (unsigned long) count; i++) {
+		events[i] = (xcb_generic_event_t *) (buf + size);
+		make_event(buf + size, i, devices);
+		size += event_size(i, devices);
+	}
+
+	for (round = 0; round < (unsigned long) rounds; round++) {
+		allocations = 0;
+		start = now_ns();
+		for (i = 0; i < (unsigned long) count; i++) {
+			adds += is_hierarchy_event(events[i], &xinput_query);
+		}
+		classify.events += count;
+		classify.ns += now_ns() - start;
+		classify.allocations += allocations;
+
+		allocations = 0;
+		start = now_ns();
+		for (i = 0; i < (unsigned long) count; i++) {
+			const xcb_input_hierarchy_event_t *e = to_hierarchy_event(events[i], &xinput_query);
+			if (e != NULL) {
+				report_devices(&wxkbd, e);
+				iterate.events++;
+			}
+		}
+		iterate.ns += now_ns() - start;
+		iterate.allocations += allocations;
+
+		allocations = 0;
+		start = now_ns();
+		for (i = 0; i < (unsigned long) count; i++) {
+			if (i % PATTERN == PATTERN - 1) {
+				continue;
+			}
+			if (wxkbd_handle_event(&wxkbd, events[i])) {
+				die("Event %lu unexpectedly needs an apply.\n", i);
+			}
+			dispatch.events++;
+		}
+		dispatch.ns += now_ns() - start;
+		dispatch.allocations += allocations;
+	}
+
+	if (adds != (unsigned long) (count / PATTERN * rounds)) {
+		die("Misclassified events: %lu adds.\n", adds);
+	}
+
+	printf("{\"events\":%ld,\"devices\":%ld,\"rounds\":%ld,", count, devices, rounds);
+	print_pass(&classify, ",");
+	print_pass(&iterate, ",");
+	print_pass(&dispatch, "}\n");
+
+	free(events);
+	free(buf);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,821 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "fakex.h"
+
+#define ARR_LEN(x) (sizeof(x)/sizeof((x)[0]))
+#define PAD4(n) (((n) + 3) & ~3)
+
+#define MAX_DEVICES 64
+#define MAX_REQUEST (1 << 18)
+
+/* Extension codes handed out by QueryExtension */
+#define XI_MAJOR 131
+#define XI_FIRST_EVENT 66
+#define XI_FIRST_ERROR 129
+#define XKB_MAJOR 135
+#define XKB_FIRST_EVENT 85
+#define XKB_FIRST_ERROR 137
+
+/* Core protocol */
+#define X_GET_INPUT_FOCUS 43
+#define X_QUERY_EXTENSION 98
+#define BAD_REQUEST 1
+#define BAD_LENGTH 16
+#define GE_GENERIC 35
+
+/* XInput 2 */
+#define XI_SELECT_EVENTS 46
+#define XI_QUERY_VERSION 47
+#define XI_QUERY_DEVICE 48
+#define XI_HIERARCHY 11
+#define XI_HIERARCHY_MASK (1 << XI_HIERARCHY)
+#define XI_MASTER_POINTER 1
+#define XI_MASTER_KEYBOARD 2
+#define XI_SLAVE_POINTER 3
+#define XI_SLAVE_KEYBOARD 4
+#define XI_MASTER_ADDED (1 << 0)
+#define XI_MASTER_REMOVED (1 << 1)
+#define XI_SLAVE_ADDED (1 << 2)
+#define XI_SLAVE_REMOVED (1 << 3)
+#define XI_DEVICE_ENABLED (1 << 6)
+#define XI_DEVICE_DISABLED (1 << 7)
+
+/* XKEYBOARD */
+#define XKB_USE_EXTENSION 0
+#define XKB_SELECT_EVENTS 1
+#define XKB_GET_CONTROLS 6
+#define XKB_SET_CONTROLS 7
+#define XKB_NEW_KEYBOARD_NOTIFY 0
+#define XKB_CONTROLS_NOTIFY 3
+#define XKB_USE_CORE_KBD 256
+#define XKB_REPEAT_KEYS (1 << 0)
+#define XKB_NKN_DEVICE_ID (1 << 2)
+#define XKB_BAD_KEYBOARD 0
+
+typedef struct Device {
+	bool present;
+	uint16_t id;
+	uint8_t type;
+	uint16_t attachment;
+	bool enabled;
+	char name[32];
+	uint16_t delay;
+	uint16_t interval;
+} Device;
+
+struct Fakex {
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	uint16_t sequence;
+	unsigned long requests;
+	unsigned int latency;
+	bool hierarchy_selected;
+	uint16_t new_keyboard_selected; /* details of NewKeyboardNotify */
+	uint32_t controls_selected;     /* details of ControlsNotify */
+	uint64_t start;
+	Device devices[MAX_DEVICES];
+	uint8_t request[MAX_REQUEST];
+};
+
+static uint64_t now_ns(void);
+static uint32_t server_time(Fakex *fakex);
+static uint16_t get16(const uint8_t *p);
+static uint32_t get32(const uint8_t *p);
+static void put16(uint8_t *p, uint16_t v);
+static void put32(uint8_t *p, uint32_t v);
+static bool read_full(int fd, void *buf, size_t len);
+static bool write_full(int fd, const void *buf, size_t len);
+static Device *find_device(Fakex *fakex, uint16_t deviceid);
+static Device *new_device(Fakex *fakex, uint16_t deviceid, uint8_t type, uint16_t attachment, const char *name);
+static bool send_reply(Fakex *fakex, uint8_t *reply, size_t len);
+static bool send_error(Fakex *fakex, uint8_t code, uint8_t major, uint8_t minor);
+static bool send_hierarchy(Fakex *fakex, const uint32_t *flags);
+static bool send_controls_notify(Fakex *fakex, const Device *device, uint8_t major, uint8_t minor);
+static bool select_xkb_events(Fakex *fakex, const uint8_t *req, size_t len);
+static bool handshake(Fakex *fakex);
+static bool query_extension(Fakex *fakex, const uint8_t *req, size_t len);
+static bool xinput_request(Fakex *fakex, const uint8_t *req, size_t len);
+static bool xkb_request(Fakex *fakex, const uint8_t *req, size_t len);
+static bool handle_request(Fakex *fakex, const uint8_t *req, size_t len);
+static void *serve(void *data);
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t
+server_time(Fakex *fakex)
+{
+	return (now_ns() - fakex->start) / 1000000;
+}
+
+static uint16_t
+get16(const uint8_t *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static void
+put16(uint8_t *p, uint16_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static bool
+read_full(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, buf, len);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf = (uint8_t *) buf + n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static bool
+write_full(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf = (const uint8_t *) buf + n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static Device *
+find_device(Fakex *fakex, uint16_t deviceid)
+{
+	size_t i;
+
+	if (deviceid == XKB_USE_CORE_KBD) {
+		deviceid = FAKEX_CORE_KEYBOARD;
+	}
+	for (i = 0; i < ARR_LEN(fakex->devices); i++) {
+		if (fakex->devices[i].present && fakex->devices[i].id == deviceid) {
+			return &fakex->devices[i];
+		}
+	}
+
+	return NULL;
+}
+
+static Device *
+new_device(Fakex *fakex, uint16_t deviceid, uint8_t type, uint16_t attachment, const char *name)
+{
+	Device *device = NULL;
+	size_t i;
+
+	if (find_device(fakex, deviceid) != NULL) {
+		return NULL;
+	}
+	for (i = 0; i < ARR_LEN(fakex->devices) && device == NULL; i++) {
+		if (!fakex->devices[i].present) {
+			device = &fakex->devices[i];
+		}
+	}
+	if (device == NULL) {
+		return NULL;
+	}
+
+	memset(device, 0, sizeof(*device));
+	device->present = true;
+	device->id = deviceid;
+	device->type = type;
+	device->attachment = attachment;
+	device->enabled = true;
+	snprintf(device->name, sizeof(device->name), "%s", name);
+	/* The X server defaults */
+	device->delay = 660;
+	device->interval = 40;
+
+	return device;
+}
+
+/* Replies and errors go out with the sequence number of the request being
+ * handled, and after the injected latency. Called with the lock held. */
+static bool
+send_reply(Fakex *fakex, uint8_t *reply, size_t len)
+{
+	struct timespec ts;
+
+	if (fakex->latency > 0) {
+		ts.tv_sec = fakex->latency / 1000000;
+		ts.tv_nsec = (fakex->latency % 1000000) * 1000;
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+	}
+
+	put16(reply + 2, fakex->sequence);
+	if (reply[0] == 1) {
+		put32(reply + 4, (len - 32) / 4);
+	}
+	return write_full(fakex->fd, reply, len);
+}
+
+static bool
+send_error(Fakex *fakex, uint8_t code, uint8_t major, uint8_t minor)
+{
+	uint8_t error[32] = { 0 };
+
+	error[1] = code;
+	put16(error + 8, minor);
+	error[10] = major;
+	return send_reply(fakex, error, sizeof(error));
+}
+
+/* Like the X server, the event lists all devices, flags[i] holds the changes
+ * of fakex->devices[i]. Called with the lock held. */
+static bool
+send_hierarchy(Fakex *fakex, const uint32_t *flags)
+{
+	uint8_t event[32 + MAX_DEVICES * 12] = { 0 };
+	uint8_t *info = event + 32;
+	uint32_t all = 0;
+	uint16_t n = 0;
+	size_t i;
+
+	if (!fakex->hierarchy_selected) {
+		return true;
+	}
+
+	for (i = 0; i < ARR_LEN(fakex->devices); i++) {
+		if (!fakex->devices[i].present && flags[i] == 0) {
+			continue;
+		}
+		put16(info + 0, fakex->devices[i].id);
+		put16(info + 2, fakex->devices[i].attachment);
+		info[4] = fakex->devices[i].type;
+		info[5] = fakex->devices[i].enabled;
+		put32(info + 8, flags[i]);
+		all |= flags[i];
+		info += 12;
+		n++;
+	}
+
+	event[0] = GE_GENERIC;
+	event[1] = XI_MAJOR;
+	put16(event + 2, fakex->sequence);
+	put32(event + 4, n * 3);
+	put16(event + 8, XI_HIERARCHY);
+	put16(event + 10, 0);
+	put32(event + 12, server_time(fakex));
+	put32(event + 16, all);
+	put16(event + 20, n);
+
+	return write_full(fakex->fd, event, 32 + n * 12);
+}
+
+/* Report a change of the repeat controls of device, made by the request major
+ * and minor, or 0 and 0 if by none. Called with the lock held. */
+static bool
+send_controls_notify(Fakex *fakex, const Device *device, uint8_t major, uint8_t minor)
+{
+	uint8_t event[32] = { 0 };
+
+	if (!(fakex->controls_selected & XKB_REPEAT_KEYS)) {
+		return true;
+	}
+
+	event[0] = XKB_FIRST_EVENT;
+	event[1] = XKB_CONTROLS_NOTIFY;
+	put16(event + 2, fakex->sequence);
+	put32(event + 4, server_time(fakex));
+	event[8] = device->id;
+	event[9] = event[10] = 1;               /* groups, before and after */
+	put32(event + 12, XKB_REPEAT_KEYS);     /* changed controls */
+	put32(event + 16, XKB_REPEAT_KEYS);     /* enabled controls */
+	event[26] = major;
+	event[27] = minor;
+
+	return write_full(fakex->fd, event, sizeof(event));
+}
+
+/* Keep track of the details selected for NewKeyboardNotify and
+ * ControlsNotify. The selection is taken as the core keyboard's, whichever
+ * device is named. */
+static bool
+select_xkb_events(Fakex *fakex, const uint8_t *req, size_t len)
+{
+	/* Bytes of the details of each event type, in the order of the bits */
+	static const uint8_t details_size[] = { 4, 0, 4, 8, 8, 8, 4, 2, 2, 2, 4, 4 };
+	uint16_t affect = get16(req + 6), clear = get16(req + 8), all = get16(req + 10);
+	const uint8_t *details = req + 16;
+	size_t i;
+
+	for (i = 0; i < ARR_LEN(details_size); i++) {
+		if (!(affect & (1 << i))) {
+			continue;
+		}
+		if (clear & (1 << i)) {
+			if (i == XKB_NEW_KEYBOARD_NOTIFY) {
+				fakex->new_keyboard_selected = 0;
+			} else if (i == XKB_CONTROLS_NOTIFY) {
+				fakex->controls_selected = 0;
+			}
+		} else if (all & (1 << i)) {
+			if (i == XKB_NEW_KEYBOARD_NOTIFY) {
+				fakex->new_keyboard_selected = UINT16_MAX;
+			} else if (i == XKB_CONTROLS_NOTIFY) {
+				fakex->controls_selected = UINT32_MAX;
+			}
+		} else {
+			if (details + details_size[i] > req + len) {
+				return send_error(fakex, BAD_LENGTH, req[0], req[1]);
+			}
+			if (i == XKB_NEW_KEYBOARD_NOTIFY) {
+				fakex->new_keyboard_selected &= ~get16(details);
+				fakex->new_keyboard_selected |= get16(details) & get16(details + 2);
+			} else if (i == XKB_CONTROLS_NOTIFY) {
+				fakex->controls_selected &= ~get32(details);
+				fakex->controls_selected |= get32(details) & get32(details + 4);
+			}
+			details += details_size[i];
+		}
+	}
+
+	return true;
+}
+
+static bool
+handshake(Fakex *fakex)
+{
+	static const char vendor[] = "fakex";
+	uint8_t setup[12], reply[40 + PAD4(sizeof(vendor) - 1) + 40] = { 0 };
+	uint8_t *screen = reply + 40 + PAD4(sizeof(vendor) - 1);
+	uint8_t auth[512];
+	size_t len;
+
+	if (!read_full(fakex->fd, setup, sizeof(setup))) {
+		return false;
+	}
+	len = PAD4(get16(setup + 6)) + PAD4(get16(setup + 8));
+	if (len > sizeof(auth) || !read_full(fakex->fd, auth, len)) {
+		return false;
+	}
+
+	reply[0] = 1;
+	put16(reply + 2, 11);
+	put16(reply + 6, (sizeof(reply) - 8) / 4);
+	put32(reply + 8, 1);                    /* release */
+	put32(reply + 12, 0x00200000);          /* resource id base */
+	put32(reply + 16, 0x001fffff);          /* resource id mask */
+	put16(reply + 24, sizeof(vendor) - 1);
+	put16(reply + 26, UINT16_MAX);          /* maximum request length */
+	reply[28] = 1;                          /* screens */
+	reply[32] = 32;                         /* bitmap scanline unit */
+	reply[33] = 32;                         /* bitmap scanline pad */
+	reply[34] = 8;                          /* min keycode */
+	reply[35] = 255;                        /* max keycode */
+	memcpy(reply + 40, vendor, sizeof(vendor) - 1);
+
+	put32(screen + 0, 0x100);               /* root */
+	put32(screen + 4, 0x20);                /* default colormap */
+	put32(screen + 8, 0xffffff);            /* white pixel */
+	put16(screen + 20, 1024);
+	put16(screen + 22, 768);
+	put16(screen + 24, 271);
+	put16(screen + 26, 203);
+	put16(screen + 28, 1);                  /* min installed maps */
+	put16(screen + 30, 1);                  /* max installed maps */
+	put32(screen + 32, 0x21);               /* root visual */
+	screen[38] = 24;                        /* root depth */
+
+	return write_full(fakex->fd, reply, sizeof(reply));
+}
+
+static bool
+query_extension(Fakex *fakex, const uint8_t *req, size_t len)
+{
+	uint8_t reply[32] = { 1 };
+	size_t name_len = get16(req + 4);
+
+	if (len < 8 + name_len) {
+		return send_error(fakex, BAD_LENGTH, req[0], 0);
+	}
+	if (name_len == 15 && memcmp(req + 8, "XInputExtension", 15) == 0) {
+		reply[8] = 1;
+		reply[9] = XI_MAJOR;
+		reply[10] = XI_FIRST_EVENT;
+		reply[11] = XI_FIRST_ERROR;
+	} else if (name_len == 9 && memcmp(req + 8, "XKEYBOARD", 9) == 0) {
+		reply[8] = 1;
+		reply[9] = XKB_MAJOR;
+		reply[10] = XKB_FIRST_EVENT;
+		reply[11] = XKB_FIRST_ERROR;
+	}
+
+	return send_reply(fakex, reply, sizeof(reply));
+}
+
+static bool
+xinput_request(Fakex *fakex, const uint8_t *req, size_t len)
+{
+	uint8_t reply[32 + MAX_DEVICES * (12 + sizeof(((Device *) 0)->name))] = { 1 };
+	uint8_t *info = reply + 32;
+	const uint8_t *mask;
+	size_t i, name_len, n = 0;
+	uint16_t deviceid;
+	Device *device;
+
+	switch (req[1]) {
+	case XI_QUERY_VERSION:
+		put16(reply + 8, 2);
+		put16(reply + 10, 2);
+		return send_reply(fakex, reply, 32);
+	case XI_SELECT_EVENTS:
+		mask = req + 12;
+		for (i = 0; i < get16(req + 8) && mask + 4 <= req + len; i++) {
+			if (get16(mask) == 0 && get16(mask + 2) > 0) {
+				fakex->hierarchy_selected = get32(mask + 4) & XI_HIERARCHY_MASK;
+			}
+			mask += 4 + get16(mask + 2) * 4;
+		}
+		return true;
+	case XI_QUERY_DEVICE:
+		deviceid = get16(req + 4);
+		for (i = 0; i < ARR_LEN(fakex->devices); i++) {
+			device = &fakex->devices[i];
+			if (!device->present
+			    || (deviceid == 1 && device->type != XI_MASTER_POINTER && device->type != XI_MASTER_KEYBOARD)
+			    || (deviceid > 1 && device->id != deviceid)) {
+				continue;
+			}
+			name_len = strlen(device->name);
+			put16(info + 0, device->id);
+			put16(info + 2, device->type);
+			put16(info + 4, device->attachment);
+			put16(info + 8, name_len);
+			info[10] = device->enabled;
+			memcpy(info + 12, device->name, name_len);
+			info += 12 + PAD4(name_len);
+			n++;
+		}
+		put16(reply + 8, n);
+		return send_reply(fakex, reply, info - reply);
+	default:
+		return send_error(fakex, BAD_REQUEST, req[0], req[1]);
+	}
+}
+
+static bool
+xkb_request(Fakex *fakex, const uint8_t *req, size_t len)
+{
+	uint8_t reply[92] = { 1 };
+	Device *device;
+
+	switch (req[1]) {
+	case XKB_USE_EXTENSION:
+		reply[1] = 1;
+		put16(reply + 8, 1);
+		put16(reply + 10, 0);
+		return send_reply(fakex, reply, 32);
+	case XKB_SELECT_EVENTS:
+		if (len < 16) {
+			return send_error(fakex, BAD_LENGTH, req[0], req[1]);
+		}
+		return select_xkb_events(fakex, req, len);
+	case XKB_GET_CONTROLS:
+		if ((device = find_device(fakex, get16(req + 4))) == NULL) {
+			return send_error(fakex, XKB_FIRST_ERROR + XKB_BAD_KEYBOARD, req[0], req[1]);
+		}
+		reply[1] = device->id;
+		put16(reply + 20, device->delay);
+		put16(reply + 22, device->interval);
+		put32(reply + 56, XKB_REPEAT_KEYS);
+		return send_reply(fakex, reply, sizeof(reply));
+	case XKB_SET_CONTROLS:
+		if (len < 100) {
+			return send_error(fakex, BAD_LENGTH, req[0], req[1]);
+		}
+		if ((device = find_device(fakex, get16(req + 4))) == NULL) {
+			return send_error(fakex, XKB_FIRST_ERROR + XKB_BAD_KEYBOARD, req[0], req[1]);
+		}
+		if ((get32(req + 32) & XKB_REPEAT_KEYS)
+		    && (device->delay != get16(req + 36) || device->interval != get16(req + 38))) {
+			device->delay = get16(req + 36);
+			device->interval = get16(req + 38);
+			return send_controls_notify(fakex, device, req[0], req[1]);
+		}
+		return true;
+	default:
+		return send_error(fakex, BAD_REQUEST, req[0], req[1]);
+	}
+}
+
+static bool
+handle_request(Fakex *fakex, const uint8_t *req, size_t len)
+{
+	uint8_t reply[32] = { 1 };
+
+	switch (req[0]) {
+	case X_GET_INPUT_FOCUS:
+		/* What xcb sends to sync with the server */
+		put32(reply + 8, 0x100);
+		return send_reply(fakex, reply, sizeof(reply));
+	case X_QUERY_EXTENSION:
+		return query_extension(fakex, req, len);
+	case XI_MAJOR:
+		return xinput_request(fakex, req, len);
+	case XKB_MAJOR:
+		return xkb_request(fakex, req, len);
+	default:
+		return send_error(fakex, BAD_REQUEST, req[0], 0);
+	}
+}
+
+static void *
+serve(void *data)
+{
+	Fakex *fakex = data;
+	size_t len;
+	bool ok;
+
+	if (!handshake(fakex)) {
+		return NULL;
+	}
+
+	for (;;) {
+		if (!read_full(fakex->fd, fakex->request, 4)) {
+			break;
+		}
+		len = get16(fakex->request + 2) * 4;
+		if (len < 4 || len > sizeof(fakex->request)
+		    || !read_full(fakex->fd, fakex->request + 4, len - 4)) {
+			break;
+		}
+
+		pthread_mutex_lock(&fakex->lock);
+		fakex->sequence++;
+		fakex->requests++;
+		ok = handle_request(fakex, fakex->request, len);
+		pthread_mutex_unlock(&fakex->lock);
+		if (!ok) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+Fakex *
+fakex_new(int *client_fd)
+{
+	Fakex *fakex;
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+		return NULL;
+	}
+	if ((fakex = fakex_serve(fds[0])) == NULL) {
+		close(fds[0]);
+		close(fds[1]);
+		return NULL;
+	}
+
+	*client_fd = fds[1];
+	return fakex;
+}
+
+Fakex *
+fakex_serve(int fd)
+{
+	Fakex *fakex;
+
+	if ((fakex = calloc(1, sizeof(*fakex))) == NULL) {
+		return NULL;
+	}
+	fakex->fd = fd;
+	fakex->start = now_ns();
+	pthread_mutex_init(&fakex->lock, NULL);
+
+	new_device(fakex, 2, XI_MASTER_POINTER, 3, "Virtual core pointer");
+	new_device(fakex, FAKEX_CORE_KEYBOARD, XI_MASTER_KEYBOARD, 2, "Virtual core keyboard");
+	new_device(fakex, 4, XI_SLAVE_POINTER, 2, "Virtual core XTEST pointer");
+	new_device(fakex, FAKEX_XTEST_KEYBOARD, XI_SLAVE_KEYBOARD, FAKEX_CORE_KEYBOARD,
+	           "Virtual core XTEST keyboard");
+
+	if (pthread_create(&fakex->thread, NULL, serve, fakex) != 0) {
+		pthread_mutex_destroy(&fakex->lock);
+		free(fakex);
+		return NULL;
+	}
+
+	return fakex;
+}
+
+void
+fakex_set_latency(Fakex *fakex, unsigned int usec)
+{
+	pthread_mutex_lock(&fakex->lock);
+	fakex->latency = usec;
+	pthread_mutex_unlock(&fakex->lock);
+}
+
+bool
+fakex_add_device(Fakex *fakex, uint16_t deviceid, uint8_t type, uint16_t attachment, const char *name)
+{
+	uint32_t flags[MAX_DEVICES] = { 0 };
+	Device *device, *pointer = NULL;
+	bool ok = false;
+
+	pthread_mutex_lock(&fakex->lock);
+	if ((device = new_device(fakex, deviceid, type, attachment, name)) == NULL) {
+		goto out;
+	}
+	if (type == XI_MASTER_KEYBOARD) {
+		pointer = new_device(fakex, deviceid + 1, XI_MASTER_POINTER, deviceid, name);
+		if (pointer == NULL) {
+			device->present = false;
+			goto out;
+		}
+		device->attachment = deviceid + 1;
+		flags[pointer - fakex->devices] = XI_MASTER_ADDED | XI_DEVICE_ENABLED;
+		flags[device - fakex->devices] = XI_MASTER_ADDED | XI_DEVICE_ENABLED;
+	} else {
+		flags[device - fakex->devices] = XI_SLAVE_ADDED | XI_DEVICE_ENABLED;
+	}
+	ok = send_hierarchy(fakex, flags);
+
+out:
+	pthread_mutex_unlock(&fakex->lock);
+	return ok;
+}
+
+bool
+fakex_remove_device(Fakex *fakex, uint16_t deviceid)
+{
+	uint32_t flags[MAX_DEVICES] = { 0 };
+	Device *device, *paired = NULL;
+	bool ok = false;
+
+	pthread_mutex_lock(&fakex->lock);
+	if ((device = find_device(fakex, deviceid)) == NULL) {
+		goto out;
+	}
+	if (device->type == XI_MASTER_KEYBOARD || device->type == XI_MASTER_POINTER) {
+		paired = find_device(fakex, device->attachment);
+	}
+
+	device->present = false;
+	device->enabled = false;
+	flags[device - fakex->devices] = (paired ? XI_MASTER_REMOVED : XI_SLAVE_REMOVED) | XI_DEVICE_DISABLED;
+	if (paired != NULL) {
+		paired->present = false;
+		paired->enabled = false;
+		flags[paired - fakex->devices] = XI_MASTER_REMOVED | XI_DEVICE_DISABLED;
+	}
+	ok = send_hierarchy(fakex, flags);
+
+out:
+	pthread_mutex_unlock(&fakex->lock);
+	return ok;
+}
+
+bool
+fakex_get_repeat(Fakex *fakex, uint16_t deviceid, uint16_t *delay, uint16_t *interval)
+{
+	Device *device;
+
+	pthread_mutex_lock(&fakex->lock);
+	if ((device = find_device(fakex, deviceid)) != NULL) {
+		*delay = device->delay;
+		*interval = device->interval;
+	}
+	pthread_mutex_unlock(&fakex->lock);
+
+	return device != NULL;
+}
+
+bool
+fakex_set_repeat(Fakex *fakex, uint16_t deviceid, uint16_t delay, uint16_t interval)
+{
+	Device *device;
+
+	pthread_mutex_lock(&fakex->lock);
+	if ((device = find_device(fakex, deviceid)) != NULL) {
+		device->delay = delay;
+		device->interval = interval;
+	}
+	pthread_mutex_unlock(&fakex->lock);
+
+	return device != NULL;
+}
+
+bool
+fakex_change_repeat(Fakex *fakex, uint16_t deviceid, uint16_t delay, uint16_t interval)
+{
+	Device *device;
+	bool ok = false;
+
+	pthread_mutex_lock(&fakex->lock);
+	if ((device = find_device(fakex, deviceid)) != NULL) {
+		device->delay = delay;
+		device->interval = interval;
+		ok = send_controls_notify(fakex, device, 0, 0);
+	}
+	pthread_mutex_unlock(&fakex->lock);
+
+	return ok;
+}
+
+bool
+fakex_new_keyboard(Fakex *fakex)
+{
+	uint8_t event[32] = { 0 };
+	bool ok = true;
+
+	pthread_mutex_lock(&fakex->lock);
+	if (fakex->new_keyboard_selected & XKB_NKN_DEVICE_ID) {
+		event[0] = XKB_FIRST_EVENT;
+		event[1] = XKB_NEW_KEYBOARD_NOTIFY;
+		put16(event + 2, fakex->sequence);
+		put32(event + 4, server_time(fakex));
+		event[8] = FAKEX_CORE_KEYBOARD;
+		event[9] = FAKEX_CORE_KEYBOARD;
+		event[10] = event[12] = 8;      /* keycodes */
+		event[11] = event[13] = 255;
+		put16(event + 16, XKB_NKN_DEVICE_ID);
+		ok = write_full(fakex->fd, event, sizeof(event));
+	}
+	pthread_mutex_unlock(&fakex->lock);
+
+	return ok;
+}
+
+unsigned long
+fakex_requests(Fakex *fakex)
+{
+	unsigned long requests;
+
+	pthread_mutex_lock(&fakex->lock);
+	requests = fakex->requests;
+	pthread_mutex_unlock(&fakex->lock);
+
+	return requests;
+}
+
+void
+fakex_free(Fakex *fakex)
+{
+	shutdown(fakex->fd, SHUT_RDWR);
+	pthread_join(fakex->thread, NULL);
+	close(fakex->fd);
+	pthread_mutex_destroy(&fakex->lock);
+	free(fakex);
+}
@@ -0,0 +1,62 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* fakex - an in-process stand-in for an X server, for deterministic
+ * benchmarks and regression runs of the wxkbd engine.
+ *
+ * A thread serves one end of a socketpair, speaking just enough of the
+ * protocol for wxkbd: the connection setup, QueryExtension, GetInputFocus,
+ * XIQueryVersion, XIQueryDevice, XISelectEvents, XkbUseExtension,
+ * XkbSelectEvents and XkbGetControls/SetControls. Hierarchy events and XKB
+ * events are scripted through the functions below, and a SetControls changing
+ * the repeat controls sends a ControlsNotify as well, all only if selected.
+ * Requests are answered in order, after an optional injected latency. The
+ * client end is for xcb_connect_to_fd().
+ *
+ * Only the byte order of the host is supported.
+ */
+
+#ifndef FAKEX_H
+#define FAKEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Device ids of the master keyboard and its XTEST slave, present from the
+ * start along with the master pointer (2) and its XTEST slave (4). */
+#define FAKEX_CORE_KEYBOARD 3
+#define FAKEX_XTEST_KEYBOARD 5
+
+typedef struct Fakex Fakex;
+
+/* Start serving, returns NULL on failure. *client_fd is set to the client
+ * end of the connection. */
+Fakex *fakex_new(int *client_fd);
+/* Serve a client already connected to fd, e.g. accepted on a listening
+ * socket. fd is closed by fakex_free(). Returns NULL on failure. */
+Fakex *fakex_serve(int fd);
+/* Delay every reply and error by usec microseconds. */
+void fakex_set_latency(Fakex *fakex, unsigned int usec);
+/* Add or remove a device and send a hierarchy event to the client if it
+ * selected them. Adding a master keyboard adds a master pointer with the
+ * next id as well, removing it removes both. */
+bool fakex_add_device(Fakex *fakex, uint16_t deviceid, uint8_t type, uint16_t attachment, const char *name);
+bool fakex_remove_device(Fakex *fakex, uint16_t deviceid);
+/* Access the repeat controls of a keyboard as XkbGetControls/SetControls
+ * would, without generating an event. */
+bool fakex_get_repeat(Fakex *fakex, uint16_t deviceid, uint16_t *delay, uint16_t *interval);
+bool fakex_set_repeat(Fakex *fakex, uint16_t deviceid, uint16_t delay, uint16_t interval);
+/* Change the repeat controls as another client's SetControls would, sending
+ * a ControlsNotify. */
+bool fakex_change_repeat(Fakex *fakex, uint16_t deviceid, uint16_t delay, uint16_t interval);
+/* Send a NewKeyboardNotify for the core keyboard, as when its keyboard is
+ * replaced by another device. */
+bool fakex_new_keyboard(Fakex *fakex);
+/* Number of requests received so far */
+unsigned long fakex_requests(Fakex *fakex);
+/* Stop serving and close the server end of the connection. */
+void fakex_free(Fakex *fakex);
+
+#endif /* FAKEX_H */
@@ -0,0 +1,388 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* hotplug - measure how fast a running wxkbd applies its settings to new
+ * keyboards.
+ *
+ * Creates and removes master devices with XIChangeHierarchy at a fixed rate.
+ * Before each one, the core keyboard is reset to a sentinel repeat delay, then
+ * XkbGetControls is polled until the settings of wxkbd are back. The latency
+ * distribution, and the CPU time and RSS of the daemon, are printed as JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+
+#include "xcbmin.h"
+
+#define ARR_LEN(x) (sizeof(x)/sizeof((x)[0]))
+
+/* XIChangeHierarchy is a list of differently sized changes, which xcb is of
+ * no help constructing. */
+#define XI_ADD_MASTER 1
+#define XI_REMOVE_MASTER 2
+#define XI_FLOATING 2
+
+typedef struct Usage {
+	double cpu_ms;
+	long rss_kb;
+} Usage;
+
+static uint64_t now_ns(void);
+static void sleep_until(uint64_t ns);
+static void query_version(void);
+static void change_hierarchy(const void *change, size_t len);
+static void add_master(const char *name);
+static void remove_master(uint16_t deviceid);
+static uint16_t wait_master_added(void);
+static void set_controls(uint16_t delay, uint16_t interval);
+static bool get_controls(uint16_t *delay, uint16_t *interval);
+static bool wait_controls(uint16_t delay, uint16_t interval, uint64_t deadline);
+static bool usage_of(long pid, Usage *usage);
+static int compare(const void *a, const void *b);
+static void die(const char *fmt, ...);
+
+static xcb_connection_t *connection;
+static const xcb_query_extension_reply_t *xinput_query;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/* XIQueryVersion 2.0, announcing the version of XInput spoken, which xcbmin
+ * leaves out as only this benchmark sends it. */
+static void
+query_version(void)
+{
+	static const xcb_protocol_request_t request = {
+		.count = 1,
+		.ext = &xcb_input_id,
+		.opcode = XCB_INPUT_XI_QUERY_VERSION,
+		.isvoid = 0,
+	};
+	uint16_t query[4] = { 0, 0, 2, 0 };  /* major_version, minor_version */
+	struct iovec parts[3];
+
+	parts[2].iov_base = query;
+	parts[2].iov_len = sizeof(query);
+	free(xcb_wait_for_reply(connection, xcb_send_request(connection, XCB_REQUEST_CHECKED, parts + 2, &request),
+	                        NULL));
+}
+
+static void
+change_hierarchy(const void *change, size_t len)
+{
+	static const xcb_protocol_request_t request = {
+		.count = 3,
+		.ext = &xcb_input_id,
+		.opcode = XCB_INPUT_XI_CHANGE_HIERARCHY,
+		.isvoid = 1,
+	};
+	static const uint8_t pad[4];
+	uint8_t header[8] = { 0, 0, 0, 0, 1 };  /* num_changes */
+	struct iovec parts[5];
+
+	parts[2].iov_base = header;
+	parts[2].iov_len = sizeof(header);
+	parts[3].iov_base = (void *) change;
+	parts[3].iov_len = len;
+	parts[4].iov_base = (void *) pad;
+	parts[4].iov_len = -len & 3;
+	xcb_send_request(connection, 0, parts + 2, &request);
+}
+
+static void
+add_master(const char *name)
+{
+	uint8_t change[8 + 64] = { 0 };
+	uint16_t name_len = strlen(name), len;
+
+	if (name_len > sizeof(change) - 8) {
+		name_len = sizeof(change) - 8;
+	}
+	len = (8 + name_len + 3) / 4;
+	memcpy(change + 0, &(uint16_t){ XI_ADD_MASTER }, 2);
+	memcpy(change + 2, &len, 2);
+	memcpy(change + 4, &name_len, 2);
+	change[6] = 1;  /* send_core */
+	change[7] = 1;  /* enable */
+	memcpy(change + 8, name, name_len);
+	change_hierarchy(change, len * 4);
+}
+
+static void
+remove_master(uint16_t deviceid)
+{
+	uint8_t change[12] = { 0 };
+
+	memcpy(change + 0, &(uint16_t){ XI_REMOVE_MASTER }, 2);
+	memcpy(change + 2, &(uint16_t){ sizeof(change) / 4 }, 2);
+	memcpy(change + 4, &deviceid, 2);
+	change[6] = XI_FLOATING;
+	change_hierarchy(change, sizeof(change));
+}
+
+static uint16_t
+wait_master_added(void)
+{
+	xcb_generic_event_t *event;
+	xcb_input_hierarchy_event_t *hierarchy;
+	xcb_input_hierarchy_info_iterator_t info;
+	uint16_t deviceid = 0;
+
+	while (deviceid == 0 && (event = xcb_wait_for_event(connection)) != NULL) {
+		hierarchy = (xcb_input_hierarchy_event_t *) event;
+		if ((event->response_type & 0x7f) == XCB_GE_GENERIC
+		    && hierarchy->extension == xinput_query->major_opcode
+		    && hierarchy->event_type == XCB_INPUT_HIERARCHY
+		    && (hierarchy->flags & XCB_INPUT_HIERARCHY_MASK_MASTER_ADDED)) {
+			info = xcb_input_hierarchy_infos_iterator(hierarchy);
+			for (; info.rem > 0; xcb_input_hierarchy_info_next(&info)) {
+				if ((info.data->flags & XCB_INPUT_HIERARCHY_MASK_MASTER_ADDED)
+				    && info.data->type == XCB_INPUT_DEVICE_TYPE_MASTER_KEYBOARD) {
+					deviceid = info.data->deviceid;
+				}
+			}
+		}
+		free(event);
+	}
+	if (deviceid == 0) {
+		die("Connection lost.\n");
+	}
+
+	return deviceid;
+}
+
+static void
+set_controls(uint16_t delay, uint16_t interval)
+{
+	const uint8_t per_key_repeat[32] = {0};
+	xcb_generic_error_t *error;
+
+	error = xcb_request_check(connection,
+	        xcb_xkb_set_controls_checked(connection, XCB_XKB_ID_USE_CORE_KBD,
+	                                     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	                                     XCB_XKB_BOOL_CTRL_REPEAT_KEYS, delay, interval,
+	                                     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, per_key_repeat));
+	if (error) {
+		die("Cannot set controls: %d\n", error->error_code);
+	}
+}
+
+static bool
+get_controls(uint16_t *delay, uint16_t *interval)
+{
+	xcb_xkb_get_controls_reply_t *reply;
+
+	reply = xcb_xkb_get_controls_reply(connection,
+	        xcb_xkb_get_controls(connection, XCB_XKB_ID_USE_CORE_KBD), NULL);
+	if (reply == NULL) {
+		return false;
+	}
+	*delay = reply->repeatDelay;
+	*interval = reply->repeatInterval;
+	free(reply);
+	return true;
+}
+
+static bool
+wait_controls(uint16_t delay, uint16_t interval, uint64_t deadline)
+{
+	uint16_t d, i;
+
+	while (now_ns() < deadline) {
+		if (!get_controls(&d, &i)) {
+			die("Cannot get controls.\n");
+		}
+		if (d == delay && i == interval) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool
+usage_of(long pid, Usage *usage)
+{
+	char path[64], line[256];
+	unsigned long utime, stime;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		return false;
+	}
+	/* Skip to after the command name, it may contain spaces. */
+	if (fscanf(f, "%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+	           &utime, &stime) != 2) {
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+	usage->cpu_ms = (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+
+	snprintf(path, sizeof(path), "/proc/%ld/status", pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		return false;
+	}
+	usage->rss_kb = -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "VmRSS: %ld", &usage->rss_kb) == 1) {
+			break;
+		}
+	}
+	fclose(f);
+
+	return true;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+die(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+	long pid = 0, count = 100, rate = 10, delay = 250, interval = 14, timeout = 1000;
+	long i, n = 0, timeouts = 0;
+	uint64_t *latencies, start, begin, sum = 0;
+	Usage before = { 0, -1 }, after = { 0, -1 };
+	xcb_input_event_mask_t *mask;
+	uint32_t mask_data[2];
+	char name[32];
+
+	while ((opt = getopt(argc, argv, "p:n:f:d:i:t:")) != -1) {
+		switch (opt) {
+		case 'p': pid = atol(optarg); break;
+		case 'n': count = atol(optarg); break;
+		case 'f': rate = atol(optarg); break;
+		case 'd': delay = atol(optarg); break;
+		case 'i': interval = atol(optarg); break;
+		case 't': timeout = atol(optarg); break;
+		default:
+			die("Usage: %s [-p wxkbd pid] [-n hotplugs] [-f per second] "
+			    "[-d delay] [-i interval] [-t timeout ms]\n", argv[0]);
+		}
+	}
+	if (count < 1 || rate < 1 || delay < 1 || delay >= UINT16_MAX || interval < 1) {
+		die("Invalid arguments.\n");
+	}
+	if ((latencies = calloc(count, sizeof(*latencies))) == NULL) {
+		die("Cannot allocate memory.\n");
+	}
+
+	connection = xcb_connect(NULL, NULL);
+	if (xcb_connection_has_error(connection)) {
+		die("Cannot connect to server.\n");
+	}
+	xinput_query = xcb_get_extension_data(connection, &xcb_input_id);
+	if (!xinput_query->present || !xcb_get_extension_data(connection, &xcb_xkb_id)->present) {
+		die("Server does not support XInput and XKB.\n");
+	}
+	query_version();
+	free(xcb_xkb_use_extension_reply(connection, xcb_xkb_use_extension(connection, 1, 0), NULL));
+
+	mask = (xcb_input_event_mask_t *) mask_data;
+	mask->deviceid = XCB_INPUT_DEVICE_ALL;
+	mask->mask_len = 1;
+	mask_data[1] = XCB_INPUT_XI_EVENT_MASK_HIERARCHY;
+	xcb_input_xi_select_events(connection, xcb_setup_roots_iterator(xcb_get_setup(connection)).data->root,
+	                           1, mask);
+
+	/* wxkbd applies its settings on startup. */
+	if (!wait_controls(delay, interval, now_ns() + 10 * 1000000000ULL)) {
+		die("wxkbd does not seem to be running with -d %ld and an interval of %ld.\n",
+		    delay, interval);
+	}
+
+	if (pid > 0) {
+		usage_of(pid, &before);
+	}
+	begin = now_ns();
+	for (i = 0; i < count; i++) {
+		sleep_until(begin + i * (1000000000ULL / rate));
+
+		set_controls(delay + 1, interval);
+		snprintf(name, sizeof(name), "wxkbd-bench-%ld", i);
+		start = now_ns();
+		add_master(name);
+		xcb_flush(connection);
+		if (wait_controls(delay, interval, start + timeout * 1000000ULL)) {
+			latencies[n] = (now_ns() - start) / 1000;
+			sum += latencies[n++];
+		} else {
+			timeouts++;
+		}
+		remove_master(wait_master_added());
+		xcb_flush(connection);
+	}
+	if (pid > 0) {
+		usage_of(pid, &after);
+	}
+
+	qsort(latencies, n, sizeof(*latencies), compare);
+	printf("{\"hotplugs\":%ld,\"rate\":%ld,\"timeouts\":%ld,\"wall_ms\":%.3f", count, rate,
+	       timeouts, (now_ns() - begin) / 1e6);
+	if (n > 0) {
+		printf(",\"latency_us\":{\"min\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu,\"mean\":%.1f}",
+		       (unsigned long long) latencies[0],
+		       (unsigned long long) latencies[n / 2],
+		       (unsigned long long) latencies[n * 9 / 10],
+		       (unsigned long long) latencies[n * 99 / 100],
+		       (unsigned long long) latencies[n - 1],
+		       (double) sum / n);
+	}
+	if (pid > 0) {
+		printf(",\"daemon_cpu_ms\":%.1f,\"daemon_rss_kb\":%ld", after.cpu_ms - before.cpu_ms, after.rss_kb);
+	}
+	printf("}\n");
+
+	free(latencies);
+	xcb_disconnect(connection);
+	return timeouts > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
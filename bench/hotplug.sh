@@ -0,0 +1,24 @@
+#!/bin/sh
+# See LICENSE file for copyright and license details.
+#
+# Run wxkbd against a private Xvfb and measure its hotplug-to-applied latency
+# with bench/hotplug. Options after the script name are passed to it.
+#
+#     $ make bench
+#     $ sh bench/hotplug.sh -n 1000 -f 50
+
+set -e
+
+WXKBD=${WXKBD:-./wxkbd}
+RATE=${RATE:-40}
+DELAY=${DELAY:-300}
+BUDGET=${BUDGET:-2}
+
+. bench/xvfb.sh
+
+"$WXKBD" -r "$RATE" -d "$DELAY" -b "$BUDGET" &
+wxkbd=$!
+
+bench/hotplug -p $wxkbd -d "$DELAY" -i $((1000 / RATE)) "$@"
+# wxkbd exits if a hotplug needed more requests than budgeted.
+kill -0 $wxkbd
@@ -0,0 +1,52 @@
+#!/bin/sh
+# See LICENSE file for copyright and license details.
+#
+# Run wxkbd with every feature enabled against a private Xvfb and check that
+# it does not wake up while nothing happens: once settled, the number of
+# context switches of the daemon must not change over a quiet interval.
+#
+# The one wakeup it is allowed is checking the settings every -v interval.
+# That interval is long here, and the quiet one has to end before the first
+# check is due, at 3/4 of it.
+#
+#     $ make bench
+#     $ SECONDS_IDLE=60 sh bench/idle.sh
+
+set -e
+
+WXKBD=${WXKBD:-./wxkbd}
+SECONDS_IDLE=${SECONDS_IDLE:-10}
+INTERVAL=${INTERVAL:-1}
+VERIFY=${VERIFY:-3600}
+
+if [ $((3 * INTERVAL + 1 + SECONDS_IDLE)) -ge $((VERIFY * 3 / 4)) ]; then
+	echo "VERIFY of $VERIFY s is too short for SECONDS_IDLE." >&2
+	exit 1
+fi
+
+# Voluntary and involuntary context switches of all threads of a process.
+switches() {
+	cat /proc/$1/task/*/status |
+		awk '/^(non)?voluntary_ctxt_switches:/ { n += $2 } END { print n }'
+}
+
+. bench/xvfb.sh
+
+"$WXKBD" -m "$tmp/wxkbd.prom" -i "$INTERVAL" -s "$tmp/bus" -t "$tmp/wxkbd.trace" \
+	-f "$tmp/recorder" -w 10 -v "$VERIFY" &
+wxkbd=$!
+
+# The metrics change once more when the first apply is confirmed, their
+# export may be pending for up to twice the interval.
+sleep $((3 * INTERVAL + 1))
+kill -0 $wxkbd
+
+before=$(switches $wxkbd)
+sleep "$SECONDS_IDLE"
+after=$(switches $wxkbd)
+
+printf '{"idle_s":%s,"wakeups":%s}\n' "$SECONDS_IDLE" $((after - before))
+if [ "$after" -ne "$before" ]; then
+	echo "wxkbd woke up $((after - before)) times while idle." >&2
+	exit 1
+fi
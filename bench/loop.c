@@ -0,0 +1,310 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* loop - run the wxkbd engine against fakex with a scripted, reproducible
+ * sequence of hotplugs.
+ *
+ * Each hotplug adds a slave keyboard after resetting the core keyboard to a
+ * sentinel delay, feeds the resulting event to the engine, waits for the
+ * apply to be confirmed and removes the keyboard again. Fails if the settings
+ * are not back after the event was handled, or if a hotplug needs more
+ * requests than allowed with -b. The engine never blocks on a hotplug, so
+ * the requests rather than its round-trips are what a change to it can add.
+ * Prints the time per hotplug and the protocol cost as JSON.
+ *
+ * The engine runs with verify-on-change, and a second part checks its XKB
+ * events: another client changing the controls has to be undone with one
+ * check, a NewKeyboardNotify has to apply again, and changes seen while an
+ * apply is in flight or pending, like those of its own applies during the
+ * hotplugs, must not be checked.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+
+#include <xcb/xcb.h>
+
+#include "fakex.h"
+#include "wxkbd.h"
+#include "metrics.h"
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define SLAVE_KEYBOARD 4
+#define BENCH_KEYBOARD 6
+
+static uint64_t now_ns(void);
+static void handle_next_event(xcb_connection_t *connection, Wxkbd *wxkbd);
+static void settle(xcb_connection_t *connection, Wxkbd *wxkbd);
+static void restore(xcb_connection_t *connection, Wxkbd *wxkbd, Fakex *fakex, uint16_t delay);
+static unsigned long check_xkb_events(xcb_connection_t *connection, Wxkbd *wxkbd, Fakex *fakex, long changes,
+                                      uint16_t delay, uint16_t interval);
+static int compare(const void *a, const void *b);
+static void die(const char *fmt, ...);
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+handle_next_event(xcb_connection_t *connection, Wxkbd *wxkbd)
+{
+	xcb_generic_event_t *event;
+
+	if ((event = xcb_wait_for_event(connection)) == NULL) {
+		die("Connection lost.\n");
+	}
+	wxkbd_handle_event(wxkbd, event);
+	free(event);
+}
+
+/* Handle events and replies until the server confirmed all applies, and the
+ * events read along with the last replies. */
+static void
+settle(xcb_connection_t *connection, Wxkbd *wxkbd)
+{
+	struct pollfd pfd = { .fd = xcb_get_file_descriptor(connection), .events = POLLIN };
+	xcb_generic_event_t *event;
+	bool done = false;
+
+	for (;;) {
+		while ((event = xcb_poll_for_event(connection)) != NULL) {
+			wxkbd_handle_event(wxkbd, event);
+			free(event);
+		}
+		if (done && wxkbd_pending(wxkbd) == 0) {
+			return;
+		}
+		wxkbd_handle_replies(wxkbd);
+		if ((done = wxkbd_pending(wxkbd) == 0)) {
+			continue;
+		}
+		if (xcb_connection_has_error(connection)) {
+			die("Connection lost.\n");
+		}
+		poll(&pfd, 1, -1);
+	}
+}
+
+/* Handle events and replies until fakex has delay again, with wxkbd's
+ * deadlines polled for every millisecond. */
+static void
+restore(xcb_connection_t *connection, Wxkbd *wxkbd, Fakex *fakex, uint16_t delay)
+{
+	struct pollfd pfd = { .fd = xcb_get_file_descriptor(connection), .events = POLLIN };
+	xcb_generic_event_t *event;
+	uint64_t timeout = now_ns() + 1000000000;
+	uint16_t d, interval;
+
+	for (;;) {
+		while ((event = xcb_poll_for_event(connection)) != NULL) {
+			wxkbd_handle_event(wxkbd, event);
+			free(event);
+		}
+		wxkbd_handle_replies(wxkbd);
+		fakex_get_repeat(fakex, FAKEX_CORE_KEYBOARD, &d, &interval);
+		if (d == delay) {
+			settle(connection, wxkbd);
+			return;
+		}
+		if (xcb_connection_has_error(connection)) {
+			die("Connection lost.\n");
+		}
+		if (now_ns() >= timeout) {
+			die("Settings not restored, delay is %u instead of %u.\n", d, delay);
+		}
+		poll(&pfd, 1, 1);
+	}
+}
+
+/* Returns the requests it took to undo the changes of another client. */
+static unsigned long
+check_xkb_events(xcb_connection_t *connection, Wxkbd *wxkbd, Fakex *fakex, long changes,
+                 uint16_t delay, uint16_t interval)
+{
+	const uint64_t *counters = wxkbd_metrics.counters;
+	uint64_t verifies = counters[METRICS_VERIFIES];
+	unsigned long requests = fakex_requests(fakex);
+	uint16_t d;
+	long i;
+
+	/* Another client's change, with nothing going on: one check each */
+	for (i = 0; i < changes; i++) {
+		fakex_change_repeat(fakex, FAKEX_CORE_KEYBOARD, delay + 1, interval);
+		restore(connection, wxkbd, fakex, delay);
+	}
+	requests = fakex_requests(fakex) - requests;
+	if (counters[METRICS_VERIFIES] - verifies != (uint64_t) changes) {
+		die("%llu checks for %ld changes.\n",
+		    (unsigned long long) (counters[METRICS_VERIFIES] - verifies), changes);
+	}
+	verifies = counters[METRICS_VERIFIES];
+
+	for (i = 0; i < changes; i++) {
+		/* While an apply is in flight: the change is read only after
+		 * sending it, and the apply overwrites it. */
+		fakex_change_repeat(fakex, FAKEX_CORE_KEYBOARD, delay + 1, interval);
+		wxkbd_apply(wxkbd);
+		settle(connection, wxkbd);
+
+		/* While one waits for the debounce period */
+		wxkbd_set_debounce(wxkbd, 1);
+		fakex_add_device(fakex, BENCH_KEYBOARD, SLAVE_KEYBOARD, FAKEX_CORE_KEYBOARD, "bench keyboard");
+		handle_next_event(connection, wxkbd);
+		fakex_change_repeat(fakex, FAKEX_CORE_KEYBOARD, delay + 1, interval);
+		handle_next_event(connection, wxkbd);
+		restore(connection, wxkbd, fakex, delay);
+		wxkbd_set_debounce(wxkbd, 0);
+		fakex_remove_device(fakex, BENCH_KEYBOARD);
+		handle_next_event(connection, wxkbd);
+
+		/* A keyboard replaced without a hierarchy event */
+		fakex_set_repeat(fakex, FAKEX_CORE_KEYBOARD, delay + 1, interval);
+		fakex_new_keyboard(fakex);
+		handle_next_event(connection, wxkbd);
+		settle(connection, wxkbd);
+		fakex_get_repeat(fakex, FAKEX_CORE_KEYBOARD, &d, &interval);
+		if (d != delay) {
+			die("New keyboard %ld: delay is %u instead of %u.\n", i, d, delay);
+		}
+	}
+	if (counters[METRICS_VERIFIES] != verifies) {
+		die("%llu checks while applying.\n", (unsigned long long) (counters[METRICS_VERIFIES] - verifies));
+	}
+	return requests;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+die(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int opt, fd;
+	long count = 10000, latency = 0, rate = 40, delay = 300, budget = 0;
+	long i, changes;
+	uint16_t d, interval;
+	uint64_t *times, start, sum = 0;
+	unsigned long requests, hotplug_requests, max_requests = 0, change_requests;
+	xcb_connection_t *connection;
+	Fakex *fakex;
+	Wxkbd *wxkbd;
+
+	while ((opt = getopt(argc, argv, "n:l:r:d:b:")) != -1) {
+		switch (opt) {
+		case 'n': count = atol(optarg); break;
+		case 'l': latency = atol(optarg); break;
+		case 'r': rate = atol(optarg); break;
+		case 'd': delay = atol(optarg); break;
+		case 'b': budget = atol(optarg); break;
+		default:
+			die("Usage: %s [-n hotplugs] [-l latency us] [-r rate] [-d delay] [-b requests]\n",
+			    argv[0]);
+		}
+	}
+	if (count < 1 || latency < 0 || rate < 1 || rate > 1000 || delay < 1 || delay >= UINT16_MAX) {
+		die("Invalid arguments.\n");
+	}
+	interval = 1000 / rate;
+	if ((times = calloc(count, sizeof(*times))) == NULL) {
+		die("Cannot allocate memory.\n");
+	}
+
+	if ((fakex = fakex_new(&fd)) == NULL) {
+		die("Cannot start fakex.\n");
+	}
+	fakex_set_latency(fakex, latency);
+	connection = xcb_connect_to_fd(fd, NULL);
+	if (xcb_connection_has_error(connection)) {
+		die("Cannot connect to fakex.\n");
+	}
+	if ((wxkbd = wxkbd_new(connection, rate, delay)) == NULL) {
+		die("Cannot set up wxkbd.\n");
+	}
+	wxkbd_set_verify_on_change(wxkbd, true);
+	settle(connection, wxkbd);
+	if (!fakex_get_repeat(fakex, FAKEX_CORE_KEYBOARD, &d, &interval) || d != delay) {
+		die("Settings not applied on startup.\n");
+	}
+
+	requests = fakex_requests(fakex);
+	for (i = 0; i < count; i++) {
+		fakex_set_repeat(fakex, FAKEX_CORE_KEYBOARD, delay + 1, interval);
+
+		hotplug_requests = fakex_requests(fakex);
+		start = now_ns();
+		fakex_add_device(fakex, BENCH_KEYBOARD, SLAVE_KEYBOARD, FAKEX_CORE_KEYBOARD, "bench keyboard");
+		handle_next_event(connection, wxkbd);
+		settle(connection, wxkbd);
+		times[i] = now_ns() - start;
+		sum += times[i];
+		hotplug_requests = fakex_requests(fakex) - hotplug_requests;
+		max_requests = MAX(max_requests, hotplug_requests);
+
+		fakex_get_repeat(fakex, FAKEX_CORE_KEYBOARD, &d, &interval);
+		if (d != delay) {
+			die("Hotplug %ld: delay is %u instead of %ld.\n", i, d, delay);
+		}
+
+		fakex_remove_device(fakex, BENCH_KEYBOARD);
+		handle_next_event(connection, wxkbd);
+	}
+	requests = fakex_requests(fakex) - requests;
+	if (wxkbd_metrics.counters[METRICS_VERIFIES] > 0) {
+		die("Checked the settings after its own applies.\n");
+	}
+
+	changes = (count < 100) ? count : 100;
+	change_requests = check_xkb_events(connection, wxkbd, fakex, changes, delay, interval);
+
+	qsort(times, count, sizeof(*times), compare);
+	printf("{\"hotplugs\":%ld,\"latency_us\":%ld,\"ns_per_hotplug\":{\"p50\":%llu,\"p99\":%llu,\"max\":%llu,\"mean\":%.1f},"
+	       "\"requests_per_hotplug\":%.2f,\"max_requests_per_hotplug\":%lu,"
+	       "\"changes\":%ld,\"requests_per_change\":%.2f}\n",
+	       count, latency,
+	       (unsigned long long) times[count / 2],
+	       (unsigned long long) times[count * 99 / 100],
+	       (unsigned long long) times[count - 1],
+	       (double) sum / count,
+	       (double) requests / count,
+	       max_requests,
+	       changes, (double) change_requests / changes);
+
+	wxkbd_free(wxkbd);
+	xcb_disconnect(connection);
+	fakex_free(fakex);
+	free(times);
+
+	if (budget > 0 && max_requests > (unsigned long) budget) {
+		die("Hotplug request budget of %ld exceeded.\n", budget);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,188 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* replay - feed an event trace recorded with wxkbd -t to the wxkbd engine,
+ * running against fakex.
+ *
+ * Events are replayed at the speed they were recorded at, multiplied by -s
+ * speed, or as fast as possible with -s 0. Before every event, the core
+ * keyboard of fakex is reset to a sentinel delay; fails if an event the
+ * engine applies the settings for does not restore them, or if one needs
+ * more requests than allowed with -b, which as in bench/loop stand in for
+ * the round-trips the engine no longer waits on. Prints the time spent
+ * handling events and the protocol cost as JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+
+#include <xcb/xcb.h>
+
+#include "xcbmin.h"
+#include "fakex.h"
+#include "trace.h"
+#include "wxkbd.h"
+
+static uint64_t now_ns(void);
+static void sleep_until(uint64_t ns);
+static void settle(xcb_connection_t *connection, Wxkbd *wxkbd);
+static void die(const char *fmt, ...);
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sleep_until(uint64_t ns)
+{
+	struct timespec ts = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+		;
+}
+
+/* Handle events and replies until the server confirmed all applies. */
+static void
+settle(xcb_connection_t *connection, Wxkbd *wxkbd)
+{
+	struct pollfd pfd = { .fd = xcb_get_file_descriptor(connection), .events = POLLIN };
+	xcb_generic_event_t *event;
+
+	for (;;) {
+		while ((event = xcb_poll_for_event(connection)) != NULL) {
+			wxkbd_handle_event(wxkbd, event);
+			free(event);
+		}
+		wxkbd_handle_replies(wxkbd);
+		if (wxkbd_pending(wxkbd) == 0) {
+			return;
+		}
+		if (xcb_connection_has_error(connection)) {
+			die("Connection lost.\n");
+		}
+		poll(&pfd, 1, -1);
+	}
+}
+
+static void
+die(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int opt, fd;
+	long latency = 0, rate = 40, delay = 300, budget = 0;
+	unsigned long events = 0, hotplugs = 0, requests, event_requests, max_requests = 0;
+	double speed = 1;
+	uint16_t d, interval;
+	uint64_t ns, start, begin, handling = 0, last = 0;
+	xcb_connection_t *connection;
+	xcb_generic_event_t *event;
+	Fakex *fakex;
+	Trace *trace;
+	Wxkbd *wxkbd;
+
+	while ((opt = getopt(argc, argv, "s:l:r:d:b:")) != -1) {
+		switch (opt) {
+		case 's': speed = atof(optarg); break;
+		case 'l': latency = atol(optarg); break;
+		case 'r': rate = atol(optarg); break;
+		case 'd': delay = atol(optarg); break;
+		case 'b': budget = atol(optarg); break;
+		default:
+			die("Usage: %s [-s speed] [-l latency us] [-r rate] [-d delay] [-b requests] trace\n",
+			    argv[0]);
+		}
+	}
+	if (optind != argc - 1) {
+		die("Usage: %s [-s speed] [-l latency us] [-r rate] [-d delay] [-b requests] trace\n",
+		    argv[0]);
+	}
+	if (speed < 0 || latency < 0 || rate < 1 || rate > 1000 || delay < 1 || delay >= UINT16_MAX) {
+		die("Invalid arguments.\n");
+	}
+	interval = 1000 / rate;
+
+	if ((fakex = fakex_new(&fd)) == NULL) {
+		die("Cannot start fakex.\n");
+	}
+	fakex_set_latency(fakex, latency);
+	connection = xcb_connect_to_fd(fd, NULL);
+	if (xcb_connection_has_error(connection)) {
+		die("Cannot connect to fakex.\n");
+	}
+	if ((wxkbd = wxkbd_new(connection, rate, delay)) == NULL) {
+		die("Cannot set up wxkbd.\n");
+	}
+	settle(connection, wxkbd);
+	trace = trace_open(argv[optind],
+	                   xcb_get_extension_data(connection, &xcb_input_id)->major_opcode,
+	                   xcb_get_extension_data(connection, &xcb_xkb_id)->first_event);
+	if (trace == NULL) {
+		exit(EXIT_FAILURE);
+	}
+
+	requests = fakex_requests(fakex);
+	start = now_ns();
+	while ((event = trace_read(trace, &ns)) != NULL) {
+		if (speed > 0) {
+			sleep_until(start + ns / speed);
+		}
+		last = ns;
+		fakex_set_repeat(fakex, FAKEX_CORE_KEYBOARD, delay + 1, interval);
+
+		begin = now_ns();
+		event_requests = fakex_requests(fakex);
+		if (wxkbd_handle_event(wxkbd, event)) {
+			settle(connection, wxkbd);
+			event_requests = fakex_requests(fakex) - event_requests;
+			if (event_requests > max_requests) {
+				max_requests = event_requests;
+			}
+			fakex_get_repeat(fakex, FAKEX_CORE_KEYBOARD, &d, &interval);
+			if (d != delay) {
+				die("Event %lu: delay is %u instead of %ld.\n", events, d, delay);
+			}
+			hotplugs++;
+		}
+		handling += now_ns() - begin;
+		events++;
+		free(event);
+	}
+	requests = fakex_requests(fakex) - requests;
+
+	printf("{\"events\":%lu,\"hotplugs\":%lu,\"speed\":%g,\"trace_ms\":%.3f,\"wall_ms\":%.3f,"
+	       "\"ns_per_event\":%.1f,\"requests\":%lu,\"max_requests_per_hotplug\":%lu}\n",
+	       events, hotplugs, speed, last / 1e6, (now_ns() - start) / 1e6,
+	       events ? (double) handling / events : 0.0, requests, max_requests);
+
+	trace_close(trace);
+	wxkbd_free(wxkbd);
+	xcb_disconnect(connection);
+	fakex_free(fakex);
+
+	if (budget > 0 && max_requests > (unsigned long) budget) {
+		die("Hotplug request budget of %ld exceeded.\n", budget);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,393 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* scale - measure what wxkbd costs per display, serving 1 to 1000 of them.
+ *
+ * Listens on the sockets of -n displays, numbered from -b base, and serves
+ * each client that connects with fakex. Then starts wxkbd with a -D option
+ * for every display, or with -1, one wxkbd per display, and waits until the
+ * settings are applied on all of them. Once settled, the resident memory,
+ * private dirty memory and file descriptors of the daemons are read from
+ * /proc. Last, a keyboard is plugged into all displays at once, and the time
+ * and CPU time until the settings are back on all of them is measured.
+ * Everything is printed as JSON, in total and per display.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "fakex.h"
+
+#define SOCKET_DIR "/tmp/.X11-unix"
+#define SLAVE_KEYBOARD 4
+#define BENCH_KEYBOARD 6
+#define TIMEOUT_NS (60 * 1000000000ULL)
+
+typedef struct Usage {
+	double cpu_ms;
+	long rss_kb;
+	long private_dirty_kb;
+	long fds;
+} Usage;
+
+typedef struct Server {
+	int listen_fd;
+	char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+	Fakex *fakex;
+} Server;
+
+static uint64_t now_ns(void);
+static void cleanup(void);
+static void sleep_ms(long ms);
+static bool listen_display(Server *server, long display);
+static void accept_clients(Server *servers, long n, int timeout_ms);
+static bool all_applied(Server *servers, long n, uint16_t delay);
+static void wait_applied(Server *servers, long n, uint16_t delay, const char *what);
+static pid_t spawn(const char *wxkbd, char **args);
+static bool usage_of(pid_t pid, Usage *usage);
+static void die(const char *fmt, ...);
+
+static Server *servers;
+static long nservers;
+static pid_t *pids;
+static long npids;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Also on failure, so that no sockets or daemons are left behind. */
+static void
+cleanup(void)
+{
+	long i;
+
+	for (i = 0; i < npids; i++) {
+		kill(pids[i], SIGTERM);
+		waitpid(pids[i], NULL, 0);
+	}
+	npids = 0;
+	for (i = 0; i < nservers; i++) {
+		unlink(servers[i].path);
+	}
+	nservers = 0;
+}
+
+static void
+sleep_ms(long ms)
+{
+	struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000 };
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+/* Listen where xcb looks for display :display. */
+static bool
+listen_display(Server *server, long display)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	snprintf(server->path, sizeof(server->path), SOCKET_DIR "/X%ld", display);
+	strcpy(addr.sun_path, server->path);
+	/* Not inherited by wxkbd, so that its descriptors can be counted. */
+	if ((server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+	    || fcntl(server->listen_fd, F_SETFD, FD_CLOEXEC) == -1
+	    || fcntl(server->listen_fd, F_SETFL, O_NONBLOCK) == -1) {
+		return false;
+	}
+	if (bind(server->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+	    || listen(server->listen_fd, 16) == -1) {
+		fprintf(stderr, "Cannot listen on %s: %s\n", server->path, strerror(errno));
+		close(server->listen_fd);
+		server->path[0] = '\0';
+		return false;
+	}
+	return true;
+}
+
+/* Serve new clients, each display is only connected to once. */
+static void
+accept_clients(Server *servers, long n, int timeout_ms)
+{
+	struct pollfd *pfds;
+	long i, npfds = 0;
+	int fd;
+
+	if ((pfds = calloc(n, sizeof(*pfds))) == NULL) {
+		die("Cannot allocate memory.\n");
+	}
+	for (i = 0; i < n; i++) {
+		if (servers[i].fakex == NULL) {
+			pfds[npfds].fd = servers[i].listen_fd;
+			pfds[npfds++].events = POLLIN;
+		}
+	}
+	if (npfds > 0 && poll(pfds, npfds, timeout_ms) > 0) {
+		for (i = 0; i < n; i++) {
+			if (servers[i].fakex != NULL
+			    || (fd = accept(servers[i].listen_fd, NULL, NULL)) == -1) {
+				continue;
+			}
+			if ((servers[i].fakex = fakex_serve(fd)) == NULL) {
+				die("Cannot start fakex.\n");
+			}
+		}
+	} else if (npfds == 0) {
+		sleep_ms(timeout_ms);
+	}
+	free(pfds);
+}
+
+static bool
+all_applied(Server *servers, long n, uint16_t delay)
+{
+	uint16_t d, interval;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		if (servers[i].fakex == NULL
+		    || !fakex_get_repeat(servers[i].fakex, FAKEX_CORE_KEYBOARD, &d, &interval)
+		    || d != delay) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void
+wait_applied(Server *servers, long n, uint16_t delay, const char *what)
+{
+	uint64_t deadline = now_ns() + TIMEOUT_NS;
+
+	while (!all_applied(servers, n, delay)) {
+		if (waitpid(-1, NULL, WNOHANG) > 0) {
+			die("wxkbd exited during %s.\n", what);
+		}
+		if (now_ns() > deadline) {
+			die("Settings not applied on all displays after %s.\n", what);
+		}
+		accept_clients(servers, n, 1);
+	}
+}
+
+static pid_t
+spawn(const char *wxkbd, char **args)
+{
+	pid_t pid;
+
+	if ((pid = fork()) == -1) {
+		die("Cannot fork: %s\n", strerror(errno));
+	}
+	if (pid == 0) {
+		execv(wxkbd, args);
+		fprintf(stderr, "Cannot run %s: %s\n", wxkbd, strerror(errno));
+		_exit(127);
+	}
+	return pid;
+}
+
+static bool
+usage_of(pid_t pid, Usage *usage)
+{
+	char path[64], line[256];
+	unsigned long utime, stime;
+	long kb;
+	struct dirent *entry;
+	DIR *dir;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%ld/stat", (long) pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		return false;
+	}
+	/* Skip to after the command name, it may contain spaces. */
+	if (fscanf(f, "%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+	           &utime, &stime) != 2) {
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+	usage->cpu_ms += (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+
+	snprintf(path, sizeof(path), "/proc/%ld/smaps_rollup", (long) pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		return false;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "Rss: %ld", &kb) == 1) {
+			usage->rss_kb += kb;
+		} else if (sscanf(line, "Private_Dirty: %ld", &kb) == 1) {
+			usage->private_dirty_kb += kb;
+		}
+	}
+	fclose(f);
+
+	snprintf(path, sizeof(path), "/proc/%ld/fd", (long) pid);
+	if ((dir = opendir(path)) == NULL) {
+		return false;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		usage->fds += entry->d_name[0] != '.';
+	}
+	closedir(dir);
+
+	return true;
+}
+
+static void
+die(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+	long n = 10, base = 4000, threads = 1, delay = 300, rate = 40, i, j, nprocs, nargs;
+	bool separate = false;
+	const char *wxkbd = "./wxkbd";
+	char **args, *arg, opts[64];
+	uint64_t start, startup, hotplug;
+	uint16_t interval;
+	Usage before = { 0 }, after = { 0 };
+	struct rlimit limit;
+
+	while ((opt = getopt(argc, argv, "n:b:j:1x:r:d:")) != -1) {
+		switch (opt) {
+		case 'n': n = atol(optarg); break;
+		case 'b': base = atol(optarg); break;
+		case 'j': threads = atol(optarg); break;
+		case '1': separate = true; break;
+		case 'x': wxkbd = optarg; break;
+		case 'r': rate = atol(optarg); break;
+		case 'd': delay = atol(optarg); break;
+		default:
+			die("Usage: %s [-n displays] [-b first display] [-j threads] [-1] "
+			    "[-x wxkbd] [-r rate] [-d delay]\n", argv[0]);
+		}
+	}
+	if (n < 1 || base < 0 || threads < 1 || rate < 1 || rate > 1000 || delay < 1 || delay >= UINT16_MAX) {
+		die("Invalid arguments.\n");
+	}
+	interval = 1000 / rate;
+
+	/* A socket per display here, and a connection per display in wxkbd */
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	mkdir(SOCKET_DIR, 01777);
+
+	nprocs = separate ? n : 1;
+	nargs = separate ? 1 : n;
+	servers = calloc(n, sizeof(*servers));
+	pids = calloc(nprocs, sizeof(*pids));
+	args = calloc(8 + 2 * nargs, sizeof(*args));
+	if (servers == NULL || pids == NULL || args == NULL) {
+		die("Cannot allocate memory.\n");
+	}
+	atexit(cleanup);
+	for (nservers = 0; nservers < n; nservers++) {
+		if (!listen_display(&servers[nservers], base + nservers)) {
+			die("Pick free displays with -b.\n");
+		}
+	}
+
+	start = now_ns();
+	for (i = 0; i < nprocs; i++) {
+		j = 0;
+		args[j++] = (char *) wxkbd;
+		snprintf(opts, sizeof(opts), "-r%ld", rate);
+		args[j++] = strdup(opts);
+		snprintf(opts, sizeof(opts), "-d%ld", delay);
+		args[j++] = strdup(opts);
+		snprintf(opts, sizeof(opts), "-j%ld", threads);
+		args[j++] = strdup(opts);
+		for (; j < 4 + 2 * nargs; j += 2) {
+			snprintf(opts, sizeof(opts), ":%ld", base + i + (j - 4) / 2);
+			args[j] = "-D";
+			args[j + 1] = arg = strdup(opts);
+			if (arg == NULL) {
+				die("Cannot allocate memory.\n");
+			}
+		}
+		args[j] = NULL;
+		pids[npids++] = spawn(wxkbd, args);
+	}
+	wait_applied(servers, n, delay, "startup");
+	startup = now_ns() - start;
+
+	/* Let startup work and allocations settle. */
+	sleep_ms(1000);
+	for (i = 0; i < nprocs; i++) {
+		if (!usage_of(pids[i], &before)) {
+			die("wxkbd %ld is gone.\n", (long) pids[i]);
+		}
+	}
+
+	/* Plug a keyboard into all displays at once. */
+	for (i = 0; i < n; i++) {
+		fakex_set_repeat(servers[i].fakex, FAKEX_CORE_KEYBOARD, delay + 1, interval);
+	}
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		fakex_add_device(servers[i].fakex, BENCH_KEYBOARD, SLAVE_KEYBOARD, FAKEX_CORE_KEYBOARD,
+		                 "bench keyboard");
+	}
+	wait_applied(servers, n, delay, "hotplug");
+	hotplug = now_ns() - start;
+	for (i = 0; i < nprocs; i++) {
+		if (!usage_of(pids[i], &after)) {
+			die("wxkbd %ld is gone.\n", (long) pids[i]);
+		}
+	}
+
+	printf("{\"displays\":%ld,\"processes\":%ld,\"threads\":%ld,"
+	       "\"startup_ms\":%.3f,\"startup_us_per_display\":%.1f,"
+	       "\"rss_kb\":%ld,\"rss_kb_per_display\":%.1f,"
+	       "\"private_dirty_kb\":%ld,\"private_dirty_kb_per_display\":%.1f,"
+	       "\"fds\":%ld,\"hotplug_ms\":%.3f,\"hotplug_cpu_ms\":%.1f}\n",
+	       n, nprocs, threads, startup / 1e6, startup / 1e3 / n,
+	       before.rss_kb, (double) before.rss_kb / n,
+	       before.private_dirty_kb, (double) before.private_dirty_kb / n,
+	       before.fds, hotplug / 1e6, after.cpu_ms - before.cpu_ms);
+
+	cleanup();
+	for (i = 0; i < n; i++) {
+		if (servers[i].fakex != NULL) {
+			fakex_free(servers[i].fakex);
+		}
+		close(servers[i].listen_fd);
+	}
+	return EXIT_SUCCESS;
+}
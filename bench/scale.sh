@@ -0,0 +1,22 @@
+#!/bin/sh
+# See LICENSE file for copyright and license details.
+#
+# Run bench/scale for 1, 10, 100 and 1000 displays, served by one wxkbd with
+# THREADS threads, and for up to SEPARATE_MAX displays by one wxkbd each.
+#
+#     $ make bench
+#     $ THREADS=4 SEPARATE_MAX=1000 sh bench/scale.sh
+
+set -e
+
+WXKBD=${WXKBD:-./wxkbd}
+THREADS=${THREADS:-1}
+SEPARATE_MAX=${SEPARATE_MAX:-100}
+
+for n in 1 10 100 1000; do
+	bench/scale -x "$WXKBD" -n $n -j "$THREADS"
+done
+for n in 1 10 100 1000; do
+	[ $n -le "$SEPARATE_MAX" ] || break
+	bench/scale -x "$WXKBD" -n $n -1
+done
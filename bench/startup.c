@@ -0,0 +1,501 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* startup - measure the time from starting wxkbd to its first confirmed
+ * apply.
+ *
+ * Starts wxkbd -n times against the server in $DISPLAY, or with -F display,
+ * against fakex serving that display. Before each start, the core keyboard is
+ * reset to a sentinel repeat delay, then polled until the settings of wxkbd
+ * are there. wxkbd is then asked for its metrics with SIGUSR2, which contain
+ * the CLOCK_MONOTONIC time of each milestone of its startup, to split the
+ * time since fork() into:
+ *
+ * - exec: execve(), dynamic linking and relocations, up to main()
+ * - connect: parsing options, starting the threads, the connection setup
+ * - extensions: querying XInput and XKB, selecting events
+ * - apply: XkbSetControls and XkbGetControls to confirm it
+ *
+ * The median and minimum of each, and of the total, are printed as JSON.
+ *
+ * With -o, wxkbd -o is measured instead: the time from fork() until it exited
+ * with the settings applied, and the round-trips it took by its metrics.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <xcb/xcb.h>
+
+#include "xcbmin.h"
+#include "fakex.h"
+
+#define SOCKET_DIR "/tmp/.X11-unix"
+#define TIMEOUT_NS (10 * 1000000000ULL)
+
+/* Milestones as named in the metrics of wxkbd */
+enum { MAIN, CONNECTED, EXTENSIONS, APPLIED, NMILESTONES };
+
+/* Phases between them, and the total */
+enum { EXEC, CONNECT, QUERY, APPLY, TOTAL, NPHASES };
+
+static uint64_t now_ns(void);
+static void sleep_ns(long ns);
+static bool listen_display(long display);
+static void set_controls(uint16_t delay, uint16_t interval);
+static bool get_controls(uint16_t *delay, uint16_t *interval);
+static void wait_applied(pid_t pid, uint16_t delay);
+static bool read_milestones(FILE *f, uint64_t *milestones);
+static void run(const char *wxkbd, char **args, uint16_t delay, uint16_t interval, uint64_t *phases);
+static void wait_exited(pid_t pid);
+static unsigned long long read_roundtrips(const char *path);
+static void run_once(const char *wxkbd, char **args, uint16_t delay, uint16_t interval, uint64_t *total,
+                     unsigned long long *roundtrips);
+static int compare(const void *a, const void *b);
+static void cleanup(void);
+static void die(const char *fmt, ...);
+
+static const char *milestone_names[NMILESTONES] = { "main", "connected", "extensions", "applied" };
+static const char *phase_names[NPHASES] = { "exec", "connect", "extensions", "apply", "total" };
+
+/* Either the server in $DISPLAY, or fakex listening on a display */
+static xcb_connection_t *connection;
+static int listen_fd = -1;
+static char listen_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+static Fakex *fakex;
+static pid_t child;
+/* Where wxkbd -o writes its metrics */
+static char metrics_path[64];
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sleep_ns(long ns)
+{
+	struct timespec ts = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+/* Listen where xcb looks for display :display. */
+static bool
+listen_display(long display)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	snprintf(listen_path, sizeof(listen_path), SOCKET_DIR "/X%ld", display);
+	strcpy(addr.sun_path, listen_path);
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+	    || fcntl(listen_fd, F_SETFD, FD_CLOEXEC) == -1
+	    || fcntl(listen_fd, F_SETFL, O_NONBLOCK) == -1) {
+		return false;
+	}
+	if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+	    || listen(listen_fd, 1) == -1) {
+		fprintf(stderr, "Cannot listen on %s: %s\n", listen_path, strerror(errno));
+		listen_path[0] = '\0';
+		return false;
+	}
+	return true;
+}
+
+static void
+set_controls(uint16_t delay, uint16_t interval)
+{
+	const uint8_t per_key_repeat[32] = {0};
+	xcb_generic_error_t *error;
+
+	error = xcb_request_check(connection,
+	        xcb_xkb_set_controls_checked(connection, XCB_XKB_ID_USE_CORE_KBD,
+	                                     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	                                     XCB_XKB_BOOL_CTRL_REPEAT_KEYS, delay, interval,
+	                                     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, per_key_repeat));
+	if (error) {
+		die("Cannot set controls: %d\n", error->error_code);
+	}
+}
+
+static bool
+get_controls(uint16_t *delay, uint16_t *interval)
+{
+	xcb_xkb_get_controls_reply_t *reply;
+
+	reply = xcb_xkb_get_controls_reply(connection,
+	        xcb_xkb_get_controls(connection, XCB_XKB_ID_USE_CORE_KBD), NULL);
+	if (reply == NULL) {
+		return false;
+	}
+	*delay = reply->repeatDelay;
+	*interval = reply->repeatInterval;
+	free(reply);
+	return true;
+}
+
+/* Poll the core keyboard until it has delay. For fakex, the connection of
+ * wxkbd is accepted first, and polling is only reading memory. */
+static void
+wait_applied(pid_t pid, uint16_t delay)
+{
+	uint64_t deadline = now_ns() + TIMEOUT_NS;
+	struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+	uint16_t d = 0, interval;
+	int fd;
+
+	while (d != delay) {
+		if (waitpid(pid, NULL, WNOHANG) != 0) {
+			child = 0;
+			die("wxkbd exited during startup.\n");
+		}
+		if (now_ns() > deadline) {
+			die("Settings not applied after %llu s.\n", TIMEOUT_NS / 1000000000);
+		}
+		if (connection != NULL) {
+			if (!get_controls(&d, &interval)) {
+				die("Cannot get controls.\n");
+			}
+		} else if (fakex == NULL) {
+			if (poll(&pfd, 1, 1) > 0 && (fd = accept(listen_fd, NULL, NULL)) != -1
+			    && (fakex = fakex_serve(fd)) == NULL) {
+				die("Cannot start fakex.\n");
+			}
+		} else if (!fakex_get_repeat(fakex, FAKEX_CORE_KEYBOARD, &d, &interval)) {
+			die("Cannot get controls.\n");
+		} else if (d != delay) {
+			sleep_ns(10000);
+		}
+	}
+}
+
+/* Read a metrics dump up to the last milestone. Returns whether it was
+ * reached. */
+static bool
+read_milestones(FILE *f, uint64_t *milestones)
+{
+	char line[256], name[32];
+	unsigned long long ns;
+	size_t i;
+
+	for (;;) {
+		if (fgets(line, sizeof(line), f) == NULL) {
+			die("wxkbd exited before reporting its startup.\n");
+		}
+		if (sscanf(line, "startup_%31[a-z]_monotonic_ns %llu", name, &ns) != 2) {
+			continue;
+		}
+		for (i = 0; i < NMILESTONES; i++) {
+			if (strcmp(name, milestone_names[i]) == 0) {
+				milestones[i] = ns;
+			}
+		}
+		if (strcmp(name, milestone_names[APPLIED]) == 0) {
+			return ns != 0;
+		}
+	}
+}
+
+static void
+run(const char *wxkbd, char **args, uint16_t delay, uint16_t interval, uint64_t *phases)
+{
+	uint64_t start, milestones[NMILESTONES];
+	int pipe_fds[2];
+	FILE *f;
+	size_t i;
+
+	if (connection != NULL) {
+		set_controls(delay + 1, interval);
+	}
+	if (pipe(pipe_fds) == -1 || (f = fdopen(pipe_fds[0], "r")) == NULL) {
+		die("Cannot create pipe: %s\n", strerror(errno));
+	}
+
+	start = now_ns();
+	if ((child = fork()) == -1) {
+		die("Cannot fork: %s\n", strerror(errno));
+	}
+	if (child == 0) {
+		dup2(pipe_fds[1], STDERR_FILENO);
+		execv(wxkbd, args);
+		_exit(127);
+	}
+	close(pipe_fds[1]);
+	wait_applied(child, delay);
+
+	/* The server has the settings before wxkbd reads the reply confirming
+	 * them. */
+	kill(child, SIGUSR2);
+	while (!read_milestones(f, milestones)) {
+		sleep_ns(100000);
+		kill(child, SIGUSR2);
+	}
+	kill(child, SIGTERM);
+	waitpid(child, NULL, 0);
+	child = 0;
+	fclose(f);
+	if (fakex != NULL) {
+		fakex_free(fakex);
+		fakex = NULL;
+	}
+
+	for (i = 0; i < NMILESTONES; i++) {
+		if (milestones[i] < start) {
+			die("wxkbd did not reach %s.\n", milestone_names[i]);
+		}
+	}
+	phases[EXEC] = milestones[MAIN] - start;
+	phases[CONNECT] = milestones[CONNECTED] - milestones[MAIN];
+	phases[QUERY] = milestones[EXTENSIONS] - milestones[CONNECTED];
+	phases[APPLY] = milestones[APPLIED] - milestones[EXTENSIONS];
+	phases[TOTAL] = milestones[APPLIED] - start;
+}
+
+/* Wait for wxkbd to exit, serving its connection if it is to fakex. */
+static void
+wait_exited(pid_t pid)
+{
+	uint64_t deadline = now_ns() + TIMEOUT_NS;
+	struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+	int fd, status;
+	pid_t exited;
+
+	for (;;) {
+		exited = waitpid(pid, &status, (listen_fd != -1 && fakex == NULL) ? WNOHANG : 0);
+		if (exited == pid) {
+			break;
+		}
+		if (exited == -1 && errno != EINTR) {
+			die("Cannot wait for wxkbd: %s\n", strerror(errno));
+		}
+		if (now_ns() > deadline) {
+			die("wxkbd did not exit after %llu s.\n", TIMEOUT_NS / 1000000000);
+		}
+		if (poll(&pfd, 1, 1) > 0 && (fd = accept(listen_fd, NULL, NULL)) != -1
+		    && (fakex = fakex_serve(fd)) == NULL) {
+			die("Cannot start fakex.\n");
+		}
+	}
+	child = 0;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		die("wxkbd -o failed.\n");
+	}
+}
+
+static unsigned long long
+read_roundtrips(const char *path)
+{
+	char line[256];
+	unsigned long long roundtrips;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		die("Cannot read %s: %s\n", path, strerror(errno));
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "wxkbd_roundtrips_total %llu", &roundtrips) == 1) {
+			fclose(f);
+			return roundtrips;
+		}
+	}
+	die("No round-trips in %s.\n", path);
+	return 0;
+}
+
+static void
+run_once(const char *wxkbd, char **args, uint16_t delay, uint16_t interval, uint64_t *total,
+         unsigned long long *roundtrips)
+{
+	uint64_t start;
+	uint16_t d = 0, got_interval;
+
+	if (connection != NULL) {
+		set_controls(delay + 1, interval);
+	}
+
+	start = now_ns();
+	if ((child = fork()) == -1) {
+		die("Cannot fork: %s\n", strerror(errno));
+	}
+	if (child == 0) {
+		execv(wxkbd, args);
+		_exit(127);
+	}
+	wait_exited(child);
+	*total = now_ns() - start;
+
+	/* wxkbd -o exits only once the settings are confirmed. */
+	if (connection != NULL ? !get_controls(&d, &got_interval)
+	    : (fakex == NULL || !fakex_get_repeat(fakex, FAKEX_CORE_KEYBOARD, &d, &got_interval))) {
+		die("Cannot get controls.\n");
+	}
+	if (d != delay) {
+		die("wxkbd -o exited without applying.\n");
+	}
+	*roundtrips = read_roundtrips(metrics_path);
+	unlink(metrics_path);
+	if (fakex != NULL) {
+		fakex_free(fakex);
+		fakex = NULL;
+	}
+}
+
+static int
+compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Also on failure, so that no daemon or socket is left behind. */
+static void
+cleanup(void)
+{
+	if (child > 0) {
+		kill(child, SIGTERM);
+		waitpid(child, NULL, 0);
+		child = 0;
+	}
+	if (listen_path[0] != '\0') {
+		unlink(listen_path);
+		listen_path[0] = '\0';
+	}
+	if (metrics_path[0] != '\0') {
+		unlink(metrics_path);
+	}
+}
+
+static void
+die(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+	long runs = 20, display = -1, rate = 40, delay = 300, i, j;
+	const char *wxkbd = "./wxkbd";
+	char *args[12], rate_arg[32], delay_arg[32], display_arg[32];
+	uint64_t *phases;
+	unsigned long long roundtrips = 0;
+	uint16_t interval;
+	bool once = false;
+
+	while ((opt = getopt(argc, argv, "n:F:x:r:d:o")) != -1) {
+		switch (opt) {
+		case 'n': runs = atol(optarg); break;
+		case 'o': once = true; break;
+		case 'F': display = atol(optarg); break;
+		case 'x': wxkbd = optarg; break;
+		case 'r': rate = atol(optarg); break;
+		case 'd': delay = atol(optarg); break;
+		default:
+			die("Usage: %s [-n runs] [-F display] [-x wxkbd] [-r rate] [-d delay] [-o]\n", argv[0]);
+		}
+	}
+	/* fakex starts out with a delay of 660, which must not be ours. */
+	if (runs < 1 || rate < 1 || rate > 1000 || delay < 1 || delay >= UINT16_MAX - 1 || delay == 660) {
+		die("Invalid arguments.\n");
+	}
+	interval = 1000 / rate;
+	if ((phases = calloc(runs * NPHASES, sizeof(*phases))) == NULL) {
+		die("Cannot allocate memory.\n");
+	}
+	signal(SIGPIPE, SIG_IGN);
+	atexit(cleanup);
+
+	j = 0;
+	args[j++] = (char *) wxkbd;
+	snprintf(rate_arg, sizeof(rate_arg), "-r%ld", rate);
+	args[j++] = rate_arg;
+	snprintf(delay_arg, sizeof(delay_arg), "-d%ld", delay);
+	args[j++] = delay_arg;
+	if (once) {
+		snprintf(metrics_path, sizeof(metrics_path), "/tmp/wxkbd-once-%ld.prom", (long) getpid());
+		args[j++] = "-o";
+		args[j++] = "-m";
+		args[j++] = metrics_path;
+	}
+	if (display >= 0) {
+		mkdir(SOCKET_DIR, 01777);
+		if (!listen_display(display)) {
+			die("Pick a free display with -F.\n");
+		}
+		snprintf(display_arg, sizeof(display_arg), ":%ld", display);
+		args[j++] = "-D";
+		args[j++] = display_arg;
+	} else {
+		connection = xcb_connect(NULL, NULL);
+		if (xcb_connection_has_error(connection)) {
+			die("Cannot connect to X server.\n");
+		}
+		xcb_discard_reply(connection, xcb_xkb_use_extension(connection, XCB_XKB_MAJOR_VERSION,
+		                                                    XCB_XKB_MINOR_VERSION).sequence);
+	}
+	args[j] = NULL;
+
+	for (i = 0; i < runs; i++) {
+		if (once) {
+			run_once(wxkbd, args, delay, interval, &phases[i * NPHASES + TOTAL], &roundtrips);
+		} else {
+			run(wxkbd, args, delay, interval, &phases[i * NPHASES]);
+		}
+	}
+
+	printf("{\"runs\":%ld,\"server\":\"%s\"", runs, (connection != NULL) ? "X" : "fakex");
+	if (once) {
+		printf(",\"roundtrips\":%llu", roundtrips);
+	}
+	for (j = once ? TOTAL : 0; j < NPHASES; j++) {
+		uint64_t *sorted = malloc(runs * sizeof(*sorted));
+
+		if (sorted == NULL) {
+			die("Cannot allocate memory.\n");
+		}
+		for (i = 0; i < runs; i++) {
+			sorted[i] = phases[i * NPHASES + j];
+		}
+		qsort(sorted, runs, sizeof(*sorted), compare);
+		printf(",\"%s_us\":{\"p50\":%.1f,\"min\":%.1f}", phase_names[j],
+		       sorted[runs / 2] / 1e3, sorted[0] / 1e3);
+		free(sorted);
+	}
+	printf("}\n");
+
+	if (connection != NULL) {
+		xcb_disconnect(connection);
+	}
+	if (listen_fd != -1) {
+		close(listen_fd);
+	}
+	free(phases);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,24 @@
+#!/bin/sh
+# See LICENSE file for copyright and license details.
+#
+# Measure the time from starting wxkbd to its first confirmed apply against a
+# private Xvfb with bench/startup, for each wxkbd binary given, e.g. to compare
+# builds. RUNS starts are measured for each, of wxkbd -o if ONCE is set.
+#
+#     $ make bench
+#     $ make MINIMAL=1 && cp wxkbd /tmp/wxkbd-default
+#     $ make clean && make MINIMAL=1 FAST=1 STATIC=1
+#     $ sh bench/startup.sh /tmp/wxkbd-default ./wxkbd
+
+set -e
+
+RUNS=${RUNS:-20}
+
+[ $# -gt 0 ] || set -- ./wxkbd
+
+. bench/xvfb.sh
+
+for binary in "$@"; do
+	printf '%s: ' "$binary"
+	bench/startup -n "$RUNS" ${ONCE:+-o} -x "$binary"
+done
@@ -0,0 +1,286 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* typing - count the events wxkbd receives while keys are typed.
+ *
+ * Starts wxkbd against the server in $DISPLAY, with -v so that it watches the
+ * repeat controls, and waits for its settings. Then -n keys are typed through
+ * XTEST, a press and a release each, and the events wxkbd received meanwhile
+ * are taken from its metrics, asked for with SIGUSR2. None of the events it
+ * selects should come from typing, any fails the run. Finally the repeat delay
+ * is changed behind its back, which it has to notice and undo, to show that
+ * the selection is not empty either. Prints the counts as JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+
+#include "xcbmin.h"
+
+#define TIMEOUT_NS (10 * 1000000000ULL)
+
+/* XTEST FakeInput, which xcb-xtest would otherwise be needed for */
+#define XTEST_FAKE_INPUT 2
+/* evdev keycode of the key typed, A on most layouts */
+#define KEYCODE 38
+
+static uint64_t now_ns(void);
+static void sleep_ns(long ns);
+static void fake_key(uint8_t type, uint8_t keycode);
+static void sync_server(void);
+static void set_controls(uint16_t delay, uint16_t interval);
+static bool get_controls(uint16_t *delay, uint16_t *interval);
+static bool wait_controls(uint16_t delay, uint64_t deadline);
+static unsigned long long read_events(FILE *f);
+static void cleanup(void);
+static void die(const char *fmt, ...);
+
+static xcb_extension_t xtest_id = { "XTEST", 0 };
+static xcb_connection_t *connection;
+static xcb_window_t root;
+static pid_t child;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sleep_ns(long ns)
+{
+	struct timespec ts = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+static void
+fake_key(uint8_t type, uint8_t keycode)
+{
+	static const xcb_protocol_request_t request = {
+		.count = 1,
+		.ext = &xtest_id,
+		.opcode = XTEST_FAKE_INPUT,
+		.isvoid = 1,
+	};
+	uint8_t fake_input[36] = { 0 };
+	struct iovec parts[3];
+
+	fake_input[4] = type;
+	fake_input[5] = keycode;
+	memcpy(fake_input + 12, &root, 4);
+	parts[2].iov_base = fake_input;
+	parts[2].iov_len = sizeof(fake_input);
+	xcb_send_request(connection, 0, parts + 2, &request);
+}
+
+static void
+sync_server(void)
+{
+	free(xcb_get_input_focus_reply(connection, xcb_get_input_focus(connection), NULL));
+}
+
+static void
+set_controls(uint16_t delay, uint16_t interval)
+{
+	const uint8_t per_key_repeat[32] = {0};
+	xcb_generic_error_t *error;
+
+	error = xcb_request_check(connection,
+	        xcb_xkb_set_controls_checked(connection, XCB_XKB_ID_USE_CORE_KBD,
+	                                     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	                                     XCB_XKB_BOOL_CTRL_REPEAT_KEYS, delay, interval,
+	                                     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, per_key_repeat));
+	if (error) {
+		die("Cannot set controls: %d\n", error->error_code);
+	}
+}
+
+static bool
+get_controls(uint16_t *delay, uint16_t *interval)
+{
+	xcb_xkb_get_controls_reply_t *reply;
+
+	reply = xcb_xkb_get_controls_reply(connection,
+	        xcb_xkb_get_controls(connection, XCB_XKB_ID_USE_CORE_KBD), NULL);
+	if (reply == NULL) {
+		return false;
+	}
+	*delay = reply->repeatDelay;
+	*interval = reply->repeatInterval;
+	free(reply);
+	return true;
+}
+
+static bool
+wait_controls(uint16_t delay, uint64_t deadline)
+{
+	uint16_t d = 0, interval;
+
+	while (now_ns() < deadline) {
+		if (waitpid(child, NULL, WNOHANG) != 0) {
+			child = 0;
+			die("wxkbd exited.\n");
+		}
+		if (!get_controls(&d, &interval)) {
+			die("Cannot get controls.\n");
+		}
+		if (d == delay) {
+			return true;
+		}
+		sleep_ns(1000000);
+	}
+	return false;
+}
+
+/* The events counter of the next metrics dump of wxkbd. The lines of earlier
+ * dumps after it don't match. */
+static unsigned long long
+read_events(FILE *f)
+{
+	char line[256];
+	unsigned long long events;
+
+	kill(child, SIGUSR2);
+	for (;;) {
+		if (fgets(line, sizeof(line), f) == NULL) {
+			die("wxkbd exited before reporting its metrics.\n");
+		}
+		if (sscanf(line, "events %llu", &events) == 1) {
+			return events;
+		}
+	}
+}
+
+static void
+cleanup(void)
+{
+	if (child > 0) {
+		kill(child, SIGTERM);
+		waitpid(child, NULL, 0);
+		child = 0;
+	}
+}
+
+static void
+die(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int opt, pipe_fds[2];
+	long keys = 10000, rate = 40, delay = 300, i;
+	const char *wxkbd = "./wxkbd";
+	char rate_arg[32], delay_arg[32];
+	unsigned long long before, typed, changed;
+	uint16_t interval;
+	uint64_t start, wall;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "n:x:r:d:")) != -1) {
+		switch (opt) {
+		case 'n': keys = atol(optarg); break;
+		case 'x': wxkbd = optarg; break;
+		case 'r': rate = atol(optarg); break;
+		case 'd': delay = atol(optarg); break;
+		default:
+			die("Usage: %s [-n keys] [-x wxkbd] [-r rate] [-d delay]\n", argv[0]);
+		}
+	}
+	if (keys < 1 || rate < 1 || rate > 1000 || delay < 1 || delay >= UINT16_MAX - 1) {
+		die("Invalid arguments.\n");
+	}
+	interval = 1000 / rate;
+	signal(SIGPIPE, SIG_IGN);
+	atexit(cleanup);
+
+	connection = xcb_connect(NULL, NULL);
+	if (xcb_connection_has_error(connection)) {
+		die("Cannot connect to X server.\n");
+	}
+	if (!xcb_get_extension_data(connection, &xtest_id)->present
+	    || !xcb_get_extension_data(connection, &xcb_xkb_id)->present) {
+		die("Server does not support XTEST and XKB.\n");
+	}
+	if (KEYCODE < xcb_get_setup(connection)->min_keycode || KEYCODE > xcb_get_setup(connection)->max_keycode) {
+		die("Server has no keycode %d.\n", KEYCODE);
+	}
+	root = xcb_setup_roots_iterator(xcb_get_setup(connection)).data->root;
+	free(xcb_xkb_use_extension_reply(connection, xcb_xkb_use_extension(connection, XCB_XKB_MAJOR_VERSION,
+	                                                                   XCB_XKB_MINOR_VERSION), NULL));
+	set_controls(delay + 1, interval);
+
+	snprintf(rate_arg, sizeof(rate_arg), "-r%ld", rate);
+	snprintf(delay_arg, sizeof(delay_arg), "-d%ld", delay);
+	if (pipe(pipe_fds) == -1 || (f = fdopen(pipe_fds[0], "r")) == NULL) {
+		die("Cannot create pipe: %s\n", strerror(errno));
+	}
+	if ((child = fork()) == -1) {
+		die("Cannot fork: %s\n", strerror(errno));
+	}
+	if (child == 0) {
+		dup2(pipe_fds[1], STDERR_FILENO);
+		execl(wxkbd, wxkbd, rate_arg, delay_arg, "-v", "3600", (char *) NULL);
+		_exit(127);
+	}
+	close(pipe_fds[1]);
+	if (!wait_controls(delay, now_ns() + TIMEOUT_NS)) {
+		die("wxkbd did not apply its settings.\n");
+	}
+	/* Let the events of its own apply arrive. */
+	sleep_ns(100000000);
+	before = read_events(f);
+
+	start = now_ns();
+	for (i = 0; i < keys; i++) {
+		fake_key(XCB_KEY_PRESS, KEYCODE);
+		fake_key(XCB_KEY_RELEASE, KEYCODE);
+		if (i % 100 == 99) {
+			sync_server();
+		}
+	}
+	sync_server();
+	wall = now_ns() - start;
+	sleep_ns(100000000);
+	typed = read_events(f) - before;
+
+	set_controls(delay + 1, interval);
+	if (!wait_controls(delay, now_ns() + TIMEOUT_NS)) {
+		die("wxkbd did not notice its settings being changed.\n");
+	}
+	sleep_ns(100000000);
+	changed = read_events(f) - before - typed;
+
+	printf("{\"keys\":%ld,\"typing_ms\":%.3f,\"events_while_typing\":%llu,\"events_on_change\":%llu}\n",
+	       keys, wall / 1e6, typed, changed);
+
+	fclose(f);
+	xcb_disconnect(connection);
+	return typed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
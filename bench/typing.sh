@@ -0,0 +1,17 @@
+#!/bin/sh
+# See LICENSE file for copyright and license details.
+#
+# Count the events wxkbd receives while typing through XTEST with
+# bench/typing, against a private Xvfb. Fails if typing reaches wxkbd at all.
+#
+#     $ make bench
+#     $ KEYS=100000 sh bench/typing.sh
+
+set -e
+
+WXKBD=${WXKBD:-./wxkbd}
+KEYS=${KEYS:-10000}
+
+. bench/xvfb.sh
+
+bench/typing -n "$KEYS" -x "$WXKBD"
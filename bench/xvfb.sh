@@ -0,0 +1,18 @@
+# See LICENSE file for copyright and license details.
+#
+# Sourced by the benchmarks that need an X server: starts a private Xvfb,
+# exports DISPLAY for it and creates the directory tmp. On exit, Xvfb and the
+# process $wxkbd, if set, are killed and tmp is removed.
+
+tmp=$(mktemp -d)
+trap 'kill $wxkbd $xvfb 2>/dev/null; rm -rf "$tmp"' EXIT INT TERM
+
+# Let Xvfb pick a free display and tell us once it accepts connections.
+Xvfb -displayfd 3 -nolisten tcp 3>"$tmp/display" 2>"$tmp/xvfb.log" &
+xvfb=$!
+while [ ! -s "$tmp/display" ]; do
+	kill -0 $xvfb 2>/dev/null || { cat "$tmp/xvfb.log" >&2; exit 1; }
+	sleep 0.05
+done
+DISPLAY=:$(cat "$tmp/display")
+export DISPLAY
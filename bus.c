@@ -0,0 +1,171 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bus.h"
+
+#define ARR_LEN(x) (sizeof(x)/sizeof((x)[0]))
+
+#define MAX_SUBSCRIBERS 32
+
+struct Bus {
+	int fd;
+	char *path;
+	int subscribers[MAX_SUBSCRIBERS];
+	size_t nsubscribers;
+	pthread_mutex_t lock;   /* of the subscribers */
+};
+
+static bool set_flags(int fd);
+static void drop(Bus *bus, size_t i);
+static void reap(Bus *bus);
+
+static bool
+set_flags(int fd)
+{
+	return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != -1
+	       && fcntl(fd, F_SETFD, FD_CLOEXEC) != -1;
+}
+
+static void
+drop(Bus *bus, size_t i)
+{
+	close(bus->subscribers[i]);
+	bus->subscribers[i] = bus->subscribers[--bus->nsubscribers];
+}
+
+/* Subscribers are never read from, so a hung up subscriber is only noticed
+ * when writing to it. Sweep them out before refusing a new one. */
+static void
+reap(Bus *bus)
+{
+	struct pollfd fds[MAX_SUBSCRIBERS];
+	size_t i;
+
+	for (i = 0; i < bus->nsubscribers; i++) {
+		fds[i].fd = bus->subscribers[i];
+		fds[i].events = 0;
+	}
+	if (poll(fds, bus->nsubscribers, 0) <= 0) {
+		return;
+	}
+	for (i = bus->nsubscribers; i-- > 0;) {
+		if (fds[i].revents & (POLLHUP | POLLERR)) {
+			drop(bus, i);
+		}
+	}
+}
+
+Bus *
+bus_new(const char *path)
+{
+	Bus *bus;
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Bus socket path too long: %s\n", path);
+		return NULL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	bus = calloc(1, sizeof(*bus));
+	if (bus == NULL || (bus->path = strdup(path)) == NULL) {
+		fprintf(stderr, "Cannot allocate memory.\n");
+		free(bus);
+		return NULL;
+	}
+	pthread_mutex_init(&bus->lock, NULL);
+
+	bus->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (bus->fd == -1 || !set_flags(bus->fd)) {
+		fprintf(stderr, "Cannot create bus socket: %s\n", strerror(errno));
+		goto fail;
+	}
+	unlink(path);
+	if (bind(bus->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+	    || listen(bus->fd, MAX_SUBSCRIBERS) == -1) {
+		fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+
+	return bus;
+
+fail:
+	if (bus->fd != -1) {
+		close(bus->fd);
+	}
+	free(bus->path);
+	pthread_mutex_destroy(&bus->lock);
+	free(bus);
+	return NULL;
+}
+
+int
+bus_fd(const Bus *bus)
+{
+	return bus->fd;
+}
+
+void
+bus_accept(Bus *bus)
+{
+	int fd;
+
+	while ((fd = accept(bus->fd, NULL, NULL)) != -1) {
+		pthread_mutex_lock(&bus->lock);
+		if (bus->nsubscribers == ARR_LEN(bus->subscribers)) {
+			reap(bus);
+		}
+		if (bus->nsubscribers == ARR_LEN(bus->subscribers) || !set_flags(fd)) {
+			close(fd);
+		} else {
+			bus->subscribers[bus->nsubscribers++] = fd;
+		}
+		pthread_mutex_unlock(&bus->lock);
+	}
+}
+
+void
+bus_publish(Bus *bus, const char *line, size_t len)
+{
+	size_t i;
+
+	pthread_mutex_lock(&bus->lock);
+	for (i = bus->nsubscribers; i-- > 0;) {
+		/* A partial write would leave the subscriber with a torn line, so
+		 * anything short of the whole line means it is too slow. */
+		if (send(bus->subscribers[i], line, len, MSG_NOSIGNAL) != (ssize_t) len) {
+			drop(bus, i);
+		}
+	}
+	pthread_mutex_unlock(&bus->lock);
+}
+
+void
+bus_free(Bus *bus)
+{
+	while (bus->nsubscribers > 0) {
+		drop(bus, 0);
+	}
+	close(bus->fd);
+	unlink(bus->path);
+	free(bus->path);
+	pthread_mutex_destroy(&bus->lock);
+	free(bus);
+}
@@ -0,0 +1,28 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Device event bus: publishes the device stream of wxkbd as JSON lines to any
+ * number of subscribers connected to a Unix stream socket. The bus never reads
+ * from subscribers and never blocks; a subscriber that cannot take a whole
+ * line right away is disconnected. Publishing is safe from any thread. */
+
+#ifndef BUS_H
+#define BUS_H
+
+#include <stddef.h>
+
+typedef struct Bus Bus;
+
+/* Listen on the socket at path, replacing a stale socket file. Returns NULL
+ * on failure. */
+Bus *bus_new(const char *path);
+/* The listening socket, readable when a subscriber is waiting. */
+int bus_fd(const Bus *bus);
+void bus_accept(Bus *bus);
+/* Send a line, including its terminating newline, to all subscribers. */
+void bus_publish(Bus *bus, const char *line, size_t len);
+void bus_free(Bus *bus);
+
+#endif /* BUS_H */
@@ -0,0 +1,174 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "export.h"
+#include "metrics.h"
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+static long resident_bytes(void);
+static void write_histogram(FILE *f, const char *name, const char *help, const Histogram *histogram);
+static void write_op_costs(FILE *f);
+static void write_metrics(FILE *f);
+
+static const char *counter_help[METRICS_NCOUNTERS] = {
+	[METRICS_EVENTS] = "X events received.",
+	[METRICS_HIERARCHY_EVENTS] = "XInput hierarchy events received.",
+	[METRICS_XKB_EVENTS] = "XKB events received.",
+	[METRICS_APPLIES] = "Keyboard settings applied and confirmed by the server.",
+	[METRICS_SKIPPED_APPLIES] = "Hierarchy events that did not need settings to be applied.",
+	[METRICS_ERRORS] = "X errors received.",
+	[METRICS_ROUNDTRIPS] = "Round-trips waited for on the X server.",
+	[METRICS_RECONNECTS] = "Connections to an X server reestablished.",
+	[METRICS_COLLAPSED_APPLIES] = "Applies folded into one already waiting to be sent.",
+	[METRICS_TIMEOUTS] = "Replies from the X server not received by their deadline.",
+	[METRICS_VERIFIES] = "Keyboards whose settings were checked with the server.",
+	[METRICS_DRIFTS] = "Checked keyboards found without the settings and applied to again.",
+};
+
+static long
+resident_bytes(void)
+{
+	FILE *f;
+	long size, resident;
+
+	if ((f = fopen("/proc/self/statm", "r")) == NULL) {
+		return -1;
+	}
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+		resident = -1;
+	}
+	fclose(f);
+
+	return (resident < 0) ? -1 : resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Only the bucket limits at the end of every power of two are exported, so
+ * that the set of series stays the same between writes. */
+static void
+write_histogram(FILE *f, const char *name, const char *help, const Histogram *histogram)
+{
+	uint64_t cumulative = 0;
+	size_t i;
+
+	fprintf(f, "# HELP %s %s\n", name, help);
+	fprintf(f, "# TYPE %s histogram\n", name);
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		cumulative += LOAD(histogram->buckets[i]);
+		if ((i + 1) % HISTOGRAM_SUB == 0) {
+			fprintf(f, "%s_bucket{le=\"%.6f\"} %llu\n", name,
+			        metrics_bucket_limit(i) / 1e6, (unsigned long long) cumulative);
+		}
+	}
+	fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) cumulative);
+	fprintf(f, "%s_sum %.6f\n", name, LOAD(histogram->sum) / 1e6);
+	fprintf(f, "%s_count %llu\n", name, (unsigned long long) cumulative);
+}
+
+static void
+write_op_costs(FILE *f)
+{
+	static const struct {
+		const char *name, *type, *help;
+		size_t offset;
+		double scale;
+	} fields[] = {
+		{ "wxkbd_operations_total", "counter", "Operations done.",
+		  offsetof(OpCost, count), 1 },
+		{ "wxkbd_operation_requests_total", "counter", "Requests sent during operations.",
+		  offsetof(OpCost, requests), 1 },
+		{ "wxkbd_operation_roundtrips_total", "counter", "Round-trips waited on during operations.",
+		  offsetof(OpCost, roundtrips), 1 },
+		{ "wxkbd_operation_blocked_seconds_total", "counter", "Time blocked on the X server during operations.",
+		  offsetof(OpCost, blocked_ns), 1e9 },
+		{ "wxkbd_operation_max_roundtrips", "gauge", "Most round-trips of a single operation.",
+		  offsetof(OpCost, max_roundtrips), 1 },
+		{ "wxkbd_operation_max_requests", "gauge", "Most requests sent during a single operation.",
+		  offsetof(OpCost, max_requests), 1 },
+	};
+	const uint64_t *value;
+	size_t i, op;
+
+	for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		fprintf(f, "# HELP %s %s\n", fields[i].name, fields[i].help);
+		fprintf(f, "# TYPE %s %s\n", fields[i].name, fields[i].type);
+		for (op = 0; op < METRICS_NOPS; op++) {
+			value = (const uint64_t *) ((const char *) &wxkbd_metrics.ops[op] + fields[i].offset);
+			fprintf(f, "%s{op=\"%s\"} ", fields[i].name, metrics_op_name(op));
+			if (fields[i].scale == 1) {
+				fprintf(f, "%llu\n", (unsigned long long) LOAD(*value));
+			} else {
+				fprintf(f, "%.9f\n", LOAD(*value) / fields[i].scale);
+			}
+		}
+	}
+}
+
+static void
+write_metrics(FILE *f)
+{
+	size_t i;
+	long rss;
+
+	write_histogram(f, "wxkbd_hotplug_latency_seconds",
+	                "Time from a hotplug event to the server confirming the settings.",
+	                &wxkbd_metrics.hotplug_latency);
+
+	for (i = 0; i < METRICS_NCOUNTERS; i++) {
+		fprintf(f, "# HELP wxkbd_%s_total %s\n", metrics_counter_name(i), counter_help[i]);
+		fprintf(f, "# TYPE wxkbd_%s_total counter\n", metrics_counter_name(i));
+		fprintf(f, "wxkbd_%s_total %llu\n", metrics_counter_name(i),
+		        (unsigned long long) LOAD(wxkbd_metrics.counters[i]));
+	}
+
+	write_op_costs(f);
+
+	fprintf(f, "# HELP wxkbd_displays_connected X servers currently connected.\n");
+	fprintf(f, "# TYPE wxkbd_displays_connected gauge\n");
+	fprintf(f, "wxkbd_displays_connected %d\n", LOAD(wxkbd_metrics.displays));
+
+	/* Sampled only here: the file is not rewritten for the resident memory
+	 * alone, which would wake up an idle daemon to find it unchanged. */
+	if ((rss = resident_bytes()) >= 0) {
+		fprintf(f, "# HELP wxkbd_resident_memory_bytes Resident set size when the other metrics last changed.\n");
+		fprintf(f, "# TYPE wxkbd_resident_memory_bytes gauge\n");
+		fprintf(f, "wxkbd_resident_memory_bytes %ld\n", rss);
+	}
+}
+
+bool
+export_write(const char *path)
+{
+	char tmp[4096];
+	FILE *f;
+
+	if ((size_t) snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp)) {
+		fprintf(stderr, "Metrics path too long: %s\n", path);
+		return false;
+	}
+	if ((f = fopen(tmp, "w")) == NULL) {
+		fprintf(stderr, "Cannot write metrics to %s: %s\n", tmp, strerror(errno));
+		return false;
+	}
+
+	write_metrics(f);
+
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		fprintf(stderr, "Cannot write metrics to %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,18 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Prometheus textfile exporter: writes the metrics in the text exposition
+ * format for the node_exporter textfile collector. */
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stdbool.h>
+
+/* Write the metrics to path. The file is written next to path first and
+ * renamed into place, so readers never see a partial file. */
+bool export_write(const char *path);
+
+#endif /* EXPORT_H */
@@ -0,0 +1,973 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+
+#include "xcbmin.h"
+#include "wxkbd.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "probes.h"
+
+#define ARR_LEN(x) (sizeof(x)/sizeof((x)[0]))
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+
+/* Applies sent and not yet confirmed, per connection. Each one is a
+ * SetControls and a GetControls, so at most twice as many requests are
+ * outstanding inside xcb and the server. */
+#define MAX_IN_FLIGHT 16
+/* XKB device specs applied to */
+#define MAX_KEYBOARDS 32
+/* Time the server has to answer, another client may hold a grab */
+#define REPLY_TIMEOUT (2 * NSEC_PER_SEC)
+
+typedef struct InputEventMask {
+	xcb_input_event_mask_t info;
+	xcb_input_xi_event_mask_t mask;
+} InputEventMask;
+
+/* The details of XkbSelectEvents for NewKeyboardNotify and ControlsNotify,
+ * in the order of their bits */
+typedef struct XkbEventDetails {
+	uint16_t affect_new_keyboard;
+	uint16_t new_keyboard_details;
+	uint32_t affect_ctrls;
+	uint32_t ctrl_details;
+} XkbEventDetails;
+
+typedef struct Keyboard {
+	uint16_t device;
+	/* An apply waits for room in the window or the end of the debounce
+	 * period. Later ones for the keyboard are folded into it, it is sent
+	 * with the settings current then. */
+	bool pending;
+	uint64_t arrival;       /* of the first event waiting, 0 if none */
+	uint64_t send_at;       /* end of the debounce period, 0 if none */
+	/* GetControls of wxkbd_verify(), 0 if none outstanding */
+	unsigned int verify_sequence;
+} Keyboard;
+
+typedef struct Apply {
+	Keyboard *keyboard;
+	unsigned int set_sequence;
+	unsigned int get_sequence;
+	uint16_t delay;
+	uint16_t interval;
+	uint64_t arrival;       /* of the hierarchy event, 0 if none */
+	uint64_t deadline;
+	bool timed_out;
+} Apply;
+
+struct Wxkbd {
+	xcb_connection_t *connection;
+	const xcb_query_extension_reply_t *xinput_query;
+	const xcb_query_extension_reply_t *xkb_query;
+	uint16_t rate;
+	uint16_t delay;
+	WxkbdDeviceFunc device_func;
+	void *device_data;
+	uint64_t debounce;
+	bool verify_on_change;
+	Keyboard keyboards[MAX_KEYBOARDS];
+	size_t nkeyboards;
+	/* Ring of applies in the order they were sent */
+	Apply applies[MAX_IN_FLIGHT];
+	size_t first;
+	size_t in_flight;
+	size_t npending;
+	unsigned int set_sequence; /* of the last SetControls sent */
+	size_t nverifying;      /* keyboards with a verify_sequence */
+	bool applied;           /* last apply completed was confirmed */
+	bool allocated;         /* by wxkbd_new() rather than the caller */
+};
+
+static const xcb_input_hierarchy_event_t *to_hierarchy_event(const xcb_generic_event_t *event, const xcb_query_extension_reply_t *xinput_info);
+static bool is_hierarchy_event(const xcb_generic_event_t *event, const xcb_query_extension_reply_t *xinput_info);
+static bool handle_xkb_event(Wxkbd *wxkbd, const xcb_generic_event_t *event);
+static Keyboard *keyboard_get(Wxkbd *wxkbd, uint16_t device);
+static bool request_apply(Wxkbd *wxkbd, uint16_t device, uint64_t arrival);
+static void send_apply(Wxkbd *wxkbd, Keyboard *keyboard, uint64_t arrival);
+static bool send_pending(Wxkbd *wxkbd);
+static bool complete_applies(Wxkbd *wxkbd);
+static bool complete_verifies(Wxkbd *wxkbd);
+static bool complete_apply(Wxkbd *wxkbd, const Apply *apply, xcb_xkb_get_controls_reply_t *reply, xcb_generic_error_t *error);
+static void complete_verify(Wxkbd *wxkbd, Keyboard *keyboard, xcb_xkb_get_controls_reply_t *reply, xcb_generic_error_t *error);
+static bool apply_in_flight(const Wxkbd *wxkbd, const Keyboard *keyboard);
+static bool wait_reply(Wxkbd *wxkbd, unsigned int sequence, void **reply, xcb_generic_error_t **error);
+static void record_request(unsigned int sequence, uint8_t major, uint8_t minor, uint16_t device);
+static void record_reply(unsigned int sequence);
+static void record_error(const xcb_generic_error_t *error);
+static void report_devices(Wxkbd *wxkbd, const xcb_input_hierarchy_event_t *event);
+
+static const xcb_input_hierarchy_event_t *
+to_hierarchy_event(const xcb_generic_event_t *event, const xcb_query_extension_reply_t *xinput_info)
+{
+	if (XCB_EVENT_RESPONSE_TYPE(event) != XCB_GE_GENERIC) {
+		return NULL;
+	}
+
+	xcb_ge_generic_event_t *generic_event = (xcb_ge_generic_event_t *) event;
+	if (generic_event->extension != xinput_info->major_opcode
+	    || generic_event->event_type != XCB_INPUT_HIERARCHY) {
+		return NULL;
+	}
+
+	return (const xcb_input_hierarchy_event_t *) generic_event;
+}
+
+static bool
+is_hierarchy_event(const xcb_generic_event_t *event, const xcb_query_extension_reply_t *xinput_info)
+{
+	const xcb_input_hierarchy_event_t *hierarchy_event = to_hierarchy_event(event, xinput_info);
+	if (hierarchy_event == NULL) {
+		return false;
+	}
+
+	if (!(hierarchy_event->flags & (XCB_INPUT_HIERARCHY_MASK_MASTER_ADDED | XCB_INPUT_HIERARCHY_MASK_SLAVE_ADDED))) {
+		PROBE2(classify, hierarchy_event->flags, 0);
+		return false;
+	}
+
+	PROBE2(classify, hierarchy_event->flags, 1);
+	return true;
+}
+
+static Keyboard *
+keyboard_get(Wxkbd *wxkbd, uint16_t device)
+{
+	size_t i;
+
+	for (i = 0; i < wxkbd->nkeyboards; i++) {
+		if (wxkbd->keyboards[i].device == device) {
+			return &wxkbd->keyboards[i];
+		}
+	}
+	if (wxkbd->nkeyboards == ARR_LEN(wxkbd->keyboards)) {
+		return NULL;
+	}
+	wxkbd->keyboards[i].device = device;
+	wxkbd->nkeyboards++;
+
+	return &wxkbd->keyboards[i];
+}
+
+/* Send an apply for device, or if the window is full, leave it pending. A
+ * wedged server thus costs at most MAX_IN_FLIGHT applies and one pending
+ * apply per keyboard, which is all it needs to catch up once it recovers.
+ * Applies for hierarchy events are held back until none came for the debounce
+ * period, so that a burst of them, like from a docking station, results in
+ * one. */
+static bool
+request_apply(Wxkbd *wxkbd, uint16_t device, uint64_t arrival)
+{
+	Keyboard *keyboard;
+
+	if (wxkbd->rate > 1000 || wxkbd->rate < 1) {
+		return false;
+	}
+	if ((keyboard = keyboard_get(wxkbd, device)) == NULL) {
+		fprintf(stderr, "Too many keyboards.\n");
+		return false;
+	}
+
+	if (keyboard->pending) {
+		metrics_count(METRICS_COLLAPSED_APPLIES);
+		/* The latency is that of the first hotplug, and the apply waits
+		 * until the burst has been quiet for the debounce period. */
+		if (arrival != 0) {
+			if (keyboard->arrival == 0) {
+				keyboard->arrival = arrival;
+			}
+			if (wxkbd->debounce > 0) {
+				keyboard->send_at = arrival + wxkbd->debounce;
+			}
+		}
+		return true;
+	}
+	if (wxkbd->in_flight == MAX_IN_FLIGHT || (arrival != 0 && wxkbd->debounce > 0)) {
+		keyboard->pending = true;
+		keyboard->arrival = arrival;
+		keyboard->send_at = (arrival != 0) ? arrival + wxkbd->debounce : 0;
+		wxkbd->npending++;
+		return true;
+	}
+
+	send_apply(wxkbd, keyboard, arrival);
+	xcb_flush(wxkbd->connection);
+	return true;
+}
+
+static void
+send_apply(Wxkbd *wxkbd, Keyboard *keyboard, uint64_t arrival)
+{
+	xcb_connection_t *connection = wxkbd->connection;
+	const uint8_t per_key_repeat[ARR_LEN(((xcb_xkb_set_controls_request_t *)0)->perKeyRepeat)] = {0};
+	Apply *apply = &wxkbd->applies[(wxkbd->first + wxkbd->in_flight) % MAX_IN_FLIGHT];
+
+	apply->keyboard = keyboard;
+	apply->delay = wxkbd->delay;
+	apply->interval = 1000 / wxkbd->rate;
+	apply->arrival = arrival;
+	apply->deadline = metrics_now() + REPLY_TIMEOUT;
+	apply->timed_out = false;
+
+	/* Also, are you f*** kidding xcb?! Why can't I just pass a struct instead
+	 * of having to specify each request argument individually. Xlib handles
+	 * this way better: not only does XkbSetControls() allow to pass a struct,
+	 * there is also a XkbSetAutoRepeatRate() function which makes this process
+	 * even simpler.
+	 */
+	apply->set_sequence = xcb_xkb_set_controls_checked(connection, keyboard->device,
+	                                      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	                                      XCB_XKB_BOOL_CTRL_REPEAT_KEYS,
+	                                      apply->delay, apply->interval,
+	                                      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, per_key_repeat).sequence;
+	record_request(apply->set_sequence, wxkbd->xkb_query->major_opcode,
+	               XCB_XKB_SET_CONTROLS, keyboard->device);
+	wxkbd->set_sequence = apply->set_sequence;
+
+	/* SetControls has no reply. Reading the controls back right after it
+	 * confirms the apply without waiting for it here, and tells whether the
+	 * server took the settings. */
+	apply->get_sequence = xcb_xkb_get_controls(connection, keyboard->device).sequence;
+	record_request(apply->get_sequence, wxkbd->xkb_query->major_opcode,
+	               XCB_XKB_GET_CONTROLS, keyboard->device);
+
+	wxkbd->in_flight++;
+}
+
+/* Fill the window with pending applies that are due, in the order of the
+ * keyboards. Returns whether any was sent. */
+static bool
+send_pending(Wxkbd *wxkbd)
+{
+	Keyboard *keyboard;
+	uint64_t now;
+	size_t i;
+	bool sent = false;
+
+	if (wxkbd->npending == 0) {
+		return false;
+	}
+	now = metrics_now();
+	for (i = 0; i < wxkbd->nkeyboards && wxkbd->in_flight < MAX_IN_FLIGHT; i++) {
+		keyboard = &wxkbd->keyboards[i];
+		if (keyboard->pending && keyboard->send_at <= now) {
+			keyboard->pending = false;
+			wxkbd->npending--;
+			/* The apply of a hotplug held back is still part of it. */
+			if (keyboard->arrival != 0) {
+				metrics_op_resume(METRICS_OP_HOTPLUG);
+			}
+			send_apply(wxkbd, keyboard, keyboard->arrival);
+			if (keyboard->arrival != 0) {
+				metrics_op_end();
+			}
+			sent = true;
+		}
+	}
+	xcb_flush(wxkbd->connection);
+	return sent;
+}
+
+/* Complete the applies whose replies have been read, in the order they were
+ * sent. Returns whether there were any. */
+static bool
+complete_applies(Wxkbd *wxkbd)
+{
+	Apply *apply;
+	void *reply;
+	xcb_generic_error_t *error;
+	bool progress = false;
+
+	while (wxkbd->in_flight > 0) {
+		apply = &wxkbd->applies[wxkbd->first];
+		if (!xcb_poll_for_reply(wxkbd->connection, apply->get_sequence, &reply, &error)) {
+			break;
+		}
+		wxkbd->applied = complete_apply(wxkbd, apply, reply, error);
+		wxkbd->first = (wxkbd->first + 1) % MAX_IN_FLIGHT;
+		wxkbd->in_flight--;
+		progress = true;
+	}
+
+	return progress;
+}
+
+/* As complete_applies(), for the checks sent by wxkbd_verify(). They are sent
+ * in the order of the keyboards, and answered in that order. */
+static bool
+complete_verifies(Wxkbd *wxkbd)
+{
+	Keyboard *keyboard;
+	void *reply;
+	xcb_generic_error_t *error;
+	bool progress = false;
+	size_t i;
+
+	if (wxkbd->nverifying == 0) {
+		return false;
+	}
+	metrics_op_begin(METRICS_OP_VERIFY);
+	for (i = 0; i < wxkbd->nkeyboards && wxkbd->nverifying > 0; i++) {
+		keyboard = &wxkbd->keyboards[i];
+		if (keyboard->verify_sequence == 0) {
+			continue;
+		}
+		if (!xcb_poll_for_reply(wxkbd->connection, keyboard->verify_sequence, &reply, &error)) {
+			break;
+		}
+		complete_verify(wxkbd, keyboard, reply, error);
+		progress = true;
+	}
+	metrics_op_end();
+
+	return progress;
+}
+
+/* Returns whether the server has the settings of apply. */
+static bool
+complete_apply(Wxkbd *wxkbd, const Apply *apply, xcb_xkb_get_controls_reply_t *reply, xcb_generic_error_t *error)
+{
+	xcb_generic_error_t *set_error = NULL;
+	void *set_reply;
+	bool applied = false;
+
+	/* Done as well, as the GetControls after it is. */
+	xcb_poll_for_reply(wxkbd->connection, apply->set_sequence, &set_reply, &set_error);
+	if (set_error) {
+		record_error(set_error);
+		fprintf(stderr, "Cannot set keyboard repeat rate and delay: %d\n", set_error->error_code);
+		free(set_error);
+	} else {
+		record_reply(apply->set_sequence);
+	}
+	if (error) {
+		record_error(error);
+		fprintf(stderr, "Cannot get keyboard controls: %d\n", error->error_code);
+		free(error);
+	} else if (reply != NULL) {
+		record_reply(apply->get_sequence);
+	}
+
+	if (set_error == NULL && reply != NULL
+	    && reply->repeatDelay == apply->delay && reply->repeatInterval == apply->interval) {
+		metrics_count(METRICS_APPLIES);
+		metrics_startup(METRICS_STARTUP_APPLIED);
+		if (apply->arrival != 0) {
+			metrics_record(&wxkbd_metrics.hotplug_latency, (metrics_now() - apply->arrival) / 1000);
+		}
+		applied = true;
+	}
+	free(reply);
+	return applied;
+}
+
+Wxkbd *
+wxkbd_new(xcb_connection_t *connection, uint16_t rate, uint16_t delay)
+{
+	Wxkbd *wxkbd;
+	void *mem;
+
+	if ((mem = malloc(sizeof(*wxkbd))) == NULL) {
+		fprintf(stderr, "Cannot allocate memory.\n");
+		return NULL;
+	}
+	if ((wxkbd = wxkbd_new_in(mem, connection, rate, delay)) == NULL) {
+		free(mem);
+		return NULL;
+	}
+	wxkbd->allocated = true;
+	return wxkbd;
+}
+
+/* Apply again if the keyboard lost the settings, unless an apply for it is
+ * sent or waiting already: the controls were read before that one. */
+static void
+complete_verify(Wxkbd *wxkbd, Keyboard *keyboard, xcb_xkb_get_controls_reply_t *reply, xcb_generic_error_t *error)
+{
+	if (error) {
+		record_error(error);
+		fprintf(stderr, "Cannot get keyboard controls: %d\n", error->error_code);
+		free(error);
+	} else if (reply != NULL) {
+		record_reply(keyboard->verify_sequence);
+		if ((reply->repeatDelay != wxkbd->delay || reply->repeatInterval != 1000 / wxkbd->rate)
+		    && !keyboard->pending && !apply_in_flight(wxkbd, keyboard)) {
+			metrics_count(METRICS_DRIFTS);
+			request_apply(wxkbd, keyboard->device, 0);
+		}
+	}
+	free(reply);
+	keyboard->verify_sequence = 0;
+	wxkbd->nverifying--;
+}
+
+static bool
+apply_in_flight(const Wxkbd *wxkbd, const Keyboard *keyboard)
+{
+	size_t i;
+
+	for (i = 0; i < wxkbd->in_flight; i++) {
+		if (wxkbd->applies[(wxkbd->first + i) % MAX_IN_FLIGHT].keyboard == keyboard) {
+			return true;
+		}
+	}
+	return false;
+}
+
+size_t
+wxkbd_size(void)
+{
+	return sizeof(Wxkbd);
+}
+
+Wxkbd *
+wxkbd_new_in(void *mem, xcb_connection_t *connection, uint16_t rate, uint16_t delay)
+{
+	Wxkbd *wxkbd = mem;
+	xcb_screen_t *screen;
+	xcb_window_t root;
+	InputEventMask input_mask;
+	XkbEventDetails xkb_details;
+	xcb_void_cookie_t select_cookie;
+	xcb_xkb_use_extension_cookie_t use_extension_cookie;
+	xcb_xkb_use_extension_reply_t *use_extension_reply;
+	xcb_get_input_focus_cookie_t focus_cookie;
+	void *focus_reply;
+	xcb_generic_error_t *error;
+
+	memset(wxkbd, 0, sizeof(*wxkbd));
+	wxkbd->connection = connection;
+	wxkbd->rate = rate;
+	wxkbd->delay = delay;
+
+	metrics_op_begin(METRICS_OP_STARTUP);
+
+	/* Query both extensions in one round-trip. xcb_get_extension_data()
+	 * blocks without a timeout, so it is only called once the reply to a
+	 * GetInputFocus sent after the queries has arrived, and with it theirs. */
+	xcb_prefetch_extension_data(connection, &xcb_input_id);
+	xcb_prefetch_extension_data(connection, &xcb_xkb_id);
+	metrics_request();
+	metrics_request();
+	focus_cookie = xcb_get_input_focus(connection);
+	metrics_request();
+	if (!wait_reply(wxkbd, focus_cookie.sequence, &focus_reply, &error)) {
+		fprintf(stderr, "Server does not answer.\n");
+		goto fail;
+	}
+	free(focus_reply);
+	free(error);
+	wxkbd->xinput_query = xcb_get_extension_data(connection, &xcb_input_id);
+	if (!wxkbd->xinput_query->present) {
+		fprintf(stderr, "Server does not support XInput.\n");
+		goto fail;
+	}
+	wxkbd->xkb_query = xcb_get_extension_data(connection, &xcb_xkb_id);
+	if (!wxkbd->xkb_query->present) {
+		fprintf(stderr, "Server does not support XKB.\n");
+		goto fail;
+	}
+
+	screen = xcb_setup_roots_iterator(xcb_get_setup(connection)).data;
+	if (screen == NULL) {
+		fprintf(stderr, "Cannot acquire screen.\n");
+		goto fail;
+	}
+
+	root = screen->root;
+
+	/* This took me a bit of figuring out:
+	 * xcb_input_xi_select_events() takes an argument of type struct
+	 * xcb_input_event_mask_t, but looking at the header, the type has no space
+	 * for the actual mask:
+	 *
+	 *      typedef struct xcb_input_event_mask_t {
+	 *          xcb_input_device_id_t deviceid;
+	 *          uint16_t              mask_len;
+	 *      } xcb_input_event_mask_t;
+	 *
+	 *  In comparison, the corresponging XIEventMask in Xlib has a mask field.
+	 *  The XCB XML protocol description *does* indicate a mask field of type list
+	 *  (array in C terms):
+	 *
+	 *     <struct name="EventMask">
+	 *         <field type="DeviceId" name="deviceid" altenum="Device" />
+	 *         <field type="CARD16" name="mask_len" />
+	 *         <list type="CARD32" name="mask" mask="XIEventMask">
+	 *             <fieldref>mask_len</fieldref>
+	 *         </list>
+	 *     </struct>
+	 *
+	 * The EventMask struct does indeed have a mask field, which is an array of
+	 * unit32_t's with a length of mask_len, though it seems we are on our own
+	 * with xcb when it comes to constructing such a data structure. Doing a
+	 * code search, there aren't that many examples. What they do is construct a
+	 * new struct with both the xcb_input_event_mask_t as a field and the actual
+	 * masks (usual just one value instead of a whole array) after that:
+	 *
+	 *     struct {
+	 *         xcb_input_event_mask_t head;
+	 *         xcb_input_xi_event_mask_t mask;
+	 *     } mask;
+	 *
+	 *     mask m;
+	 *     m.head.deviceid = XCB_INPUT_DEVICE_ALL;
+	 *     m.head.mask_len = 1 // sizeof(m.mask) / sizeof(unit32_t) in case of multiple masks
+	 *     m.mask = XCB_INPUT_EVENT_MASK_MOTION;
+	 *
+	 *     xcb_input_xi_select_events(conn, scr->root, 1, &m.head);
+	 *
+	 * When we receive such a list from the server, xcb generates iterator
+	 * methods like xcb_input_xi_event_masks_iterator() and
+	 * xcb_input_xi_event_mask_next(), but when we have to construct such data,
+	 * we are on our own apparently.
+	 */
+
+	/* The server reports hierarchy changes as coming from XIAllDevices, so
+	 * this cannot be narrowed to master keyboards, but they only come on
+	 * hotplug. DeviceChanged, sent whenever typing switches between slave
+	 * keyboards, is not selected. */
+	input_mask.info.deviceid = XCB_INPUT_DEVICE_ALL;
+	input_mask.info.mask_len = 1;
+	input_mask.mask = XCB_INPUT_XI_EVENT_MASK_HIERARCHY;
+	select_cookie = xcb_input_xi_select_events(connection, root, 1, &input_mask.info);
+	record_request(select_cookie.sequence, wxkbd->xinput_query->major_opcode,
+	               XCB_INPUT_XI_SELECT_EVENTS, input_mask.info.deviceid);
+	xcb_flush(connection);
+
+	/* This took a while to figure out: before using the XKB extension, a call
+	 * to xcb_xkb_use_extension() is required, otherwise normal XKB requests
+	 * will return an Access Error. */
+	use_extension_cookie = xcb_xkb_use_extension(connection, XCB_XKB_MAJOR_VERSION, XCB_XKB_MINOR_VERSION);
+	record_request(use_extension_cookie.sequence, wxkbd->xkb_query->major_opcode,
+	               XCB_XKB_USE_EXTENSION, 0);
+	if (!wait_reply(wxkbd, use_extension_cookie.sequence, (void **) &use_extension_reply, &error)) {
+		fprintf(stderr, "Server does not answer.\n");
+		goto fail;
+	}
+	if (error) {
+		record_error(error);
+		fprintf(stderr, "Cannot use XKB: %d\n", error->error_code);
+		free(error);
+		goto fail;
+	}
+	record_reply(use_extension_cookie.sequence);
+	free(use_extension_reply);
+
+	/* Only what concerns the settings, on the core keyboard: ControlsNotify
+	 * for the repeat controls, and NewKeyboardNotify for a keyboard replaced
+	 * with another device. Its details for the keycodes and geometry are
+	 * left out, the server sends those whenever typing switches between
+	 * slave keyboards. Neither comes while typing otherwise. */
+	xkb_details.affect_new_keyboard = XCB_XKB_NKN_DETAIL_DEVICE_ID;
+	xkb_details.new_keyboard_details = XCB_XKB_NKN_DETAIL_DEVICE_ID;
+	xkb_details.affect_ctrls = XCB_XKB_BOOL_CTRL_REPEAT_KEYS;
+	xkb_details.ctrl_details = XCB_XKB_BOOL_CTRL_REPEAT_KEYS;
+	select_cookie = xcb_xkb_select_events(connection, XCB_XKB_ID_USE_CORE_KBD,
+	                                      XCB_XKB_EVENT_TYPE_NEW_KEYBOARD_NOTIFY | XCB_XKB_EVENT_TYPE_CONTROLS_NOTIFY,
+	                                      0, 0, 0, 0, &xkb_details);
+	record_request(select_cookie.sequence, wxkbd->xkb_query->major_opcode,
+	               XCB_XKB_SELECT_EVENTS, XCB_XKB_ID_USE_CORE_KBD);
+	metrics_startup(METRICS_STARTUP_EXTENSIONS);
+
+	/* Set repeat rate and delay once on startup. */
+	request_apply(wxkbd, XCB_XKB_ID_USE_CORE_KBD, 0);
+
+	metrics_op_end();
+	return wxkbd;
+
+fail:
+	metrics_op_end();
+	return NULL;
+}
+
+bool
+wxkbd_apply_once(xcb_connection_t *connection, uint16_t rate, uint16_t delay)
+{
+	Wxkbd wxkbd;
+	xcb_xkb_use_extension_cookie_t use_extension_cookie;
+	xcb_xkb_use_extension_reply_t *use_extension_reply = NULL;
+	xcb_get_input_focus_cookie_t focus_cookie;
+	xcb_generic_error_t *error = NULL, *use_extension_error = NULL;
+	Keyboard *keyboard;
+	void *reply;
+	bool applied = false;
+
+	memset(&wxkbd, 0, sizeof(wxkbd));
+	wxkbd.connection = connection;
+	wxkbd.rate = rate;
+	wxkbd.delay = delay;
+	if (rate > 1000 || rate < 1) {
+		return false;
+	}
+
+	metrics_op_begin(METRICS_OP_STARTUP);
+
+	/* As in wxkbd_new_in(), without XInput. */
+	xcb_prefetch_extension_data(connection, &xcb_xkb_id);
+	metrics_request();
+	focus_cookie = xcb_get_input_focus(connection);
+	metrics_request();
+	if (!wait_reply(&wxkbd, focus_cookie.sequence, &reply, &error)) {
+		fprintf(stderr, "Server does not answer.\n");
+		goto out;
+	}
+	free(reply);
+	free(error);
+	wxkbd.xkb_query = xcb_get_extension_data(connection, &xcb_xkb_id);
+	if (!wxkbd.xkb_query->present) {
+		fprintf(stderr, "Server does not support XKB.\n");
+		goto out;
+	}
+	metrics_startup(METRICS_STARTUP_EXTENSIONS);
+
+	/* The server handles the requests in order, so the apply can follow
+	 * XkbUseExtension right away. If XKB cannot be used, the apply fails
+	 * with an Access error. */
+	use_extension_cookie = xcb_xkb_use_extension(connection, XCB_XKB_MAJOR_VERSION, XCB_XKB_MINOR_VERSION);
+	record_request(use_extension_cookie.sequence, wxkbd.xkb_query->major_opcode,
+	               XCB_XKB_USE_EXTENSION, 0);
+	keyboard = keyboard_get(&wxkbd, XCB_XKB_ID_USE_CORE_KBD);
+	send_apply(&wxkbd, keyboard, 0);
+	if (!wait_reply(&wxkbd, wxkbd.applies[0].get_sequence, &reply, &error)) {
+		fprintf(stderr, "Server does not answer.\n");
+		goto out;
+	}
+
+	/* Answered before the GetControls */
+	xcb_poll_for_reply(connection, use_extension_cookie.sequence, (void **) &use_extension_reply,
+	                   &use_extension_error);
+	if (use_extension_error) {
+		record_error(use_extension_error);
+		fprintf(stderr, "Cannot use XKB: %d\n", use_extension_error->error_code);
+		free(use_extension_error);
+	} else {
+		record_reply(use_extension_cookie.sequence);
+	}
+	free(use_extension_reply);
+	applied = complete_apply(&wxkbd, &wxkbd.applies[0], reply, error);
+
+out:
+	metrics_op_end();
+	return applied;
+}
+
+/* Wait up to REPLY_TIMEOUT for the reply or error to request. Unlike the
+ * xcb_*_reply() functions, this gives up if another client holds a grab or
+ * the server hangs. Returns false on timeout or if the connection broke. */
+static bool
+wait_reply(Wxkbd *wxkbd, unsigned int sequence, void **reply, xcb_generic_error_t **error)
+{
+	struct pollfd pfd = { .fd = xcb_get_file_descriptor(wxkbd->connection), .events = POLLIN };
+	uint64_t start, now, deadline;
+
+	*reply = NULL;
+	*error = NULL;
+	start = metrics_now();
+	deadline = start + REPLY_TIMEOUT;
+	xcb_flush(wxkbd->connection);
+	while (!xcb_poll_for_reply(wxkbd->connection, sequence, reply, error)) {
+		now = metrics_now();
+		if (now >= deadline) {
+			metrics_count(METRICS_TIMEOUTS);
+			metrics_roundtrip(now - start);
+			xcb_discard_reply(wxkbd->connection, sequence);
+			return false;
+		}
+		if (poll(&pfd, 1, (deadline - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC) == -1 && errno != EINTR) {
+			break;
+		}
+	}
+	metrics_roundtrip(metrics_now() - start);
+
+	return *reply != NULL || *error != NULL;
+}
+
+static void
+record_request(unsigned int sequence, uint8_t major, uint8_t minor, uint16_t device)
+{
+	PROBE3(request, sequence, major, minor);
+	metrics_request();
+	recorder_record(RECORD_REQUEST, sequence, major, minor, device);
+}
+
+static void
+record_reply(unsigned int sequence)
+{
+	PROBE2(reply, sequence, 0);
+	recorder_record(RECORD_REPLY, sequence, 0, 0, 0);
+}
+
+static void
+record_error(const xcb_generic_error_t *error)
+{
+	PROBE2(reply, error->full_sequence, error->error_code);
+	metrics_count(METRICS_ERRORS);
+	recorder_record(RECORD_ERROR, error->full_sequence, error->error_code,
+	                error->major_code, error->minor_code);
+}
+
+static void
+report_devices(Wxkbd *wxkbd, const xcb_input_hierarchy_event_t *event)
+{
+	xcb_input_hierarchy_info_iterator_t info;
+	WxkbdDevice device;
+
+	device.time = event->time;
+	info = xcb_input_hierarchy_infos_iterator(event);
+	for (; info.rem > 0; xcb_input_hierarchy_info_next(&info)) {
+		/* The event lists every device, only report the changed ones. */
+		if (info.data->flags == 0) {
+			continue;
+		}
+		device.deviceid = info.data->deviceid;
+		device.attachment = info.data->attachment;
+		device.type = info.data->type;
+		device.enabled = info.data->enabled;
+		device.flags = info.data->flags;
+		recorder_record(RECORD_DEVICE, device.deviceid, device.attachment, device.type, device.flags);
+		if (wxkbd->device_func != NULL) {
+			wxkbd->device_func(&device, wxkbd->device_data);
+		}
+	}
+}
+
+bool
+wxkbd_handle_event(Wxkbd *wxkbd, const xcb_generic_event_t *event)
+{
+	const xcb_input_hierarchy_event_t *e;
+	uint64_t arrival;
+
+	PROBE1(event, event->response_type);
+	metrics_count(METRICS_EVENTS);
+	e = to_hierarchy_event(event, wxkbd->xinput_query);
+	if (e == NULL) {
+		return handle_xkb_event(wxkbd, event);
+	}
+
+	arrival = metrics_now();
+	metrics_count(METRICS_HIERARCHY_EVENTS);
+	metrics_event(e->time, arrival);
+	recorder_record(RECORD_EVENT, e->response_type, e->extension, e->event_type, e->full_sequence);
+
+	report_devices(wxkbd, e);
+
+	if (!is_hierarchy_event(event, wxkbd->xinput_query)) {
+		metrics_count(METRICS_SKIPPED_APPLIES);
+		return false;
+	}
+
+	/* This just bluntly reapplies the rate and delay settings to the (emulated)
+	 * core keyboard. In the future one may set the configuration on the devices
+	 * individually using the deviceid from the XCB_INPUT_HIERARCHY event.
+	 */
+	metrics_op_begin(METRICS_OP_HOTPLUG);
+	request_apply(wxkbd, XCB_XKB_ID_USE_CORE_KBD, arrival);
+	metrics_op_end();
+
+	return true;
+}
+
+/* A new keyboard is applied to like a hotplugged one. A change of the repeat
+ * controls is checked with wxkbd_verify(), unless it may be one of ours: those
+ * are reported while they are in flight. */
+static bool
+handle_xkb_event(Wxkbd *wxkbd, const xcb_generic_event_t *event)
+{
+	const xcb_xkb_controls_notify_event_t *controls = (const xcb_xkb_controls_notify_event_t *) event;
+	uint64_t arrival;
+
+	if (XCB_EVENT_RESPONSE_TYPE(event) != wxkbd->xkb_query->first_event) {
+		return false;
+	}
+
+	arrival = metrics_now();
+	metrics_count(METRICS_XKB_EVENTS);
+	recorder_record(RECORD_EVENT, event->response_type, wxkbd->xkb_query->major_opcode,
+	                controls->xkbType, event->full_sequence);
+
+	switch (controls->xkbType) {
+	case XCB_XKB_NEW_KEYBOARD_NOTIFY:
+		metrics_op_begin(METRICS_OP_HOTPLUG);
+		request_apply(wxkbd, XCB_XKB_ID_USE_CORE_KBD, arrival);
+		metrics_op_end();
+		return true;
+	case XCB_XKB_CONTROLS_NOTIFY:
+		/* A change the server made up to the last SetControls of wxkbd,
+		 * the one of that SetControls included, was overwritten by it and
+		 * checked by the GetControls after it. The event can still be
+		 * read after that reply. */
+		if (!wxkbd->verify_on_change || !(controls->changedControls & XCB_XKB_BOOL_CTRL_REPEAT_KEYS)
+		    || (int) (event->full_sequence - wxkbd->set_sequence) <= 0
+		    || wxkbd->in_flight > 0 || wxkbd->npending > 0 || wxkbd->nverifying > 0) {
+			return false;
+		}
+		wxkbd_verify(wxkbd);
+		return true;
+	}
+	return false;
+}
+
+void
+wxkbd_set_debounce(Wxkbd *wxkbd, unsigned int msec)
+{
+	wxkbd->debounce = msec * NSEC_PER_MSEC;
+}
+
+void
+wxkbd_set_verify_on_change(Wxkbd *wxkbd, bool enable)
+{
+	wxkbd->verify_on_change = enable;
+}
+
+void
+wxkbd_set_repeat(Wxkbd *wxkbd, uint16_t rate, uint16_t delay)
+{
+	wxkbd->rate = rate;
+	wxkbd->delay = delay;
+}
+
+void
+wxkbd_set_device_func(Wxkbd *wxkbd, WxkbdDeviceFunc func, void *data)
+{
+	wxkbd->device_func = func;
+	wxkbd->device_data = data;
+}
+
+void
+wxkbd_handle_replies(Wxkbd *wxkbd)
+{
+	Apply *apply;
+	bool progress;
+	uint64_t now;
+	size_t i;
+
+	/* Sending, like a drift restored or a pending apply, may read further
+	 * replies from the socket, which would otherwise only be looked at with
+	 * the next event or timeout. */
+	do {
+		do {
+			progress = complete_applies(wxkbd);
+			progress = complete_verifies(wxkbd) || progress;
+		} while (progress);
+	} while (send_pending(wxkbd));
+
+	/* Overdue applies are only counted. They stay in the window, the server
+	 * answers them once it is back, e.g. when the grab ends, and resending
+	 * would only queue more requests on a server that doesn't keep up. */
+	now = metrics_now();
+	for (i = 0; i < wxkbd->in_flight; i++) {
+		apply = &wxkbd->applies[(wxkbd->first + i) % MAX_IN_FLIGHT];
+		if (!apply->timed_out && now >= apply->deadline) {
+			apply->timed_out = true;
+			metrics_count(METRICS_TIMEOUTS);
+			fprintf(stderr, "Server did not confirm settings within %llu s.\n",
+			        REPLY_TIMEOUT / NSEC_PER_SEC);
+		}
+	}
+}
+
+uint64_t
+wxkbd_deadline(const Wxkbd *wxkbd)
+{
+	const Apply *apply;
+	const Keyboard *keyboard;
+	uint64_t deadline = 0;
+	size_t i;
+
+	for (i = 0; i < wxkbd->in_flight; i++) {
+		apply = &wxkbd->applies[(wxkbd->first + i) % MAX_IN_FLIGHT];
+		if (!apply->timed_out) {
+			deadline = apply->deadline;
+			break;
+		}
+	}
+	/* Debounced applies, unless they wait for the window anyway */
+	for (i = 0; i < wxkbd->nkeyboards && wxkbd->npending > 0 && wxkbd->in_flight < MAX_IN_FLIGHT; i++) {
+		keyboard = &wxkbd->keyboards[i];
+		if (keyboard->pending && (deadline == 0 || keyboard->send_at < deadline)) {
+			deadline = keyboard->send_at;
+		}
+	}
+
+	return deadline;
+}
+
+unsigned int
+wxkbd_pending(const Wxkbd *wxkbd)
+{
+	return wxkbd->in_flight + wxkbd->npending;
+}
+
+bool
+wxkbd_applied(const Wxkbd *wxkbd)
+{
+	return wxkbd->applied;
+}
+
+bool
+wxkbd_apply(Wxkbd *wxkbd)
+{
+	return request_apply(wxkbd, XCB_XKB_ID_USE_CORE_KBD, 0);
+}
+
+void
+wxkbd_verify(Wxkbd *wxkbd)
+{
+	Keyboard *keyboard;
+	size_t i;
+
+	if (wxkbd->nverifying > 0) {
+		return;
+	}
+	metrics_op_begin(METRICS_OP_VERIFY);
+	for (i = 0; i < wxkbd->nkeyboards; i++) {
+		keyboard = &wxkbd->keyboards[i];
+		keyboard->verify_sequence = xcb_xkb_get_controls(wxkbd->connection, keyboard->device).sequence;
+		record_request(keyboard->verify_sequence, wxkbd->xkb_query->major_opcode,
+		               XCB_XKB_GET_CONTROLS, keyboard->device);
+		metrics_count(METRICS_VERIFIES);
+		wxkbd->nverifying++;
+	}
+	xcb_flush(wxkbd->connection);
+	metrics_op_end();
+}
+
+void
+wxkbd_free(Wxkbd *wxkbd)
+{
+	const Apply *apply;
+	size_t i;
+
+	/* Let xcb drop the replies still to come. */
+	for (; wxkbd->in_flight > 0; wxkbd->in_flight--) {
+		apply = &wxkbd->applies[wxkbd->first];
+		xcb_discard_reply(wxkbd->connection, apply->set_sequence);
+		xcb_discard_reply(wxkbd->connection, apply->get_sequence);
+		wxkbd->first = (wxkbd->first + 1) % MAX_IN_FLIGHT;
+	}
+	for (i = 0; i < wxkbd->nkeyboards; i++) {
+		if (wxkbd->keyboards[i].verify_sequence != 0) {
+			xcb_discard_reply(wxkbd->connection, wxkbd->keyboards[i].verify_sequence);
+		}
+	}
+	if (wxkbd->allocated) {
+		free(wxkbd);
+	}
+}
@@ -0,0 +1,277 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "metrics.h"
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define ADD(x, n) __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+typedef struct CurrentOp {
+	unsigned int depth;
+	MetricsOp op;
+	bool resumed;
+	uint64_t requests;
+	uint64_t roundtrips;
+	uint64_t blocked_ns;
+} CurrentOp;
+
+static size_t bucket(uint64_t usec);
+
+Metrics wxkbd_metrics;
+static __thread CurrentOp current;
+
+static const char *counter_names[METRICS_NCOUNTERS] = {
+	[METRICS_EVENTS] = "events",
+	[METRICS_HIERARCHY_EVENTS] = "hierarchy_events",
+	[METRICS_XKB_EVENTS] = "xkb_events",
+	[METRICS_APPLIES] = "applies",
+	[METRICS_SKIPPED_APPLIES] = "skipped_applies",
+	[METRICS_ERRORS] = "errors",
+	[METRICS_ROUNDTRIPS] = "roundtrips",
+	[METRICS_RECONNECTS] = "reconnects",
+	[METRICS_COLLAPSED_APPLIES] = "collapsed_applies",
+	[METRICS_TIMEOUTS] = "timeouts",
+	[METRICS_VERIFIES] = "verifies",
+	[METRICS_DRIFTS] = "drifts",
+};
+
+static const char *op_names[METRICS_NOPS] = {
+	[METRICS_OP_STARTUP] = "startup",
+	[METRICS_OP_HOTPLUG] = "hotplug",
+	[METRICS_OP_RECONNECT] = "reconnect",
+	[METRICS_OP_RELOAD] = "reload",
+	[METRICS_OP_VERIFY] = "verify",
+};
+
+static const char *startup_names[METRICS_NSTARTUP] = {
+	[METRICS_STARTUP_MAIN] = "main",
+	[METRICS_STARTUP_CONNECTED] = "connected",
+	[METRICS_STARTUP_EXTENSIONS] = "extensions",
+	[METRICS_STARTUP_APPLIED] = "applied",
+};
+
+static size_t
+bucket(uint64_t usec)
+{
+	unsigned int exponent;
+
+	if (usec > UINT32_MAX) {
+		usec = UINT32_MAX;
+	}
+	if (usec < HISTOGRAM_SUB) {
+		return usec;
+	}
+
+	exponent = 31 - __builtin_clz((uint32_t) usec);
+	return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB
+	       + ((usec >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1));
+}
+
+uint64_t
+metrics_bucket_limit(size_t i)
+{
+	unsigned int shift;
+
+	if (i < HISTOGRAM_SUB) {
+		return i;
+	}
+
+	shift = i / HISTOGRAM_SUB - 1;
+	return ((uint64_t) (HISTOGRAM_SUB + i % HISTOGRAM_SUB + 1) << shift) - 1;
+}
+
+uint64_t
+metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+const char *
+metrics_counter_name(MetricsCounter counter)
+{
+	return counter_names[counter];
+}
+
+const char *
+metrics_op_name(MetricsOp op)
+{
+	return op_names[op];
+}
+
+void
+metrics_count(MetricsCounter counter)
+{
+	ADD(wxkbd_metrics.counters[counter], 1);
+}
+
+void
+metrics_displays(int delta)
+{
+	ADD(wxkbd_metrics.displays, delta);
+}
+
+void
+metrics_record(Histogram *histogram, uint64_t usec)
+{
+	ADD(histogram->buckets[bucket(usec)], 1);
+	ADD(histogram->sum, usec);
+	ADD(histogram->count, 1);
+}
+
+void
+metrics_op_begin(MetricsOp op)
+{
+	if (current.depth++ == 0) {
+		current.op = op;
+		current.resumed = false;
+		current.requests = 0;
+		current.roundtrips = 0;
+		current.blocked_ns = 0;
+	}
+}
+
+void
+metrics_op_resume(MetricsOp op)
+{
+	metrics_op_begin(op);
+	if (current.depth == 1) {
+		current.resumed = true;
+	}
+}
+
+void
+metrics_op_end(void)
+{
+	OpCost *cost;
+	uint64_t max;
+
+	if (--current.depth > 0) {
+		return;
+	}
+
+	cost = &wxkbd_metrics.ops[current.op];
+	if (!current.resumed) {
+		ADD(cost->count, 1);
+	}
+	ADD(cost->requests, current.requests);
+	ADD(cost->roundtrips, current.roundtrips);
+	ADD(cost->blocked_ns, current.blocked_ns);
+	max = LOAD(cost->max_roundtrips);
+	while (current.roundtrips > max
+	       && !__atomic_compare_exchange_n(&cost->max_roundtrips, &max, current.roundtrips,
+	                                       false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	max = LOAD(cost->max_requests);
+	while (current.requests > max
+	       && !__atomic_compare_exchange_n(&cost->max_requests, &max, current.requests,
+	                                       false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void
+metrics_request(void)
+{
+	current.requests++;
+}
+
+void
+metrics_roundtrip(uint64_t blocked_ns)
+{
+	current.roundtrips++;
+	current.blocked_ns += blocked_ns;
+	ADD(wxkbd_metrics.counters[METRICS_ROUNDTRIPS], 1);
+}
+
+void
+metrics_event(uint32_t time, uint64_t ns)
+{
+	STORE(wxkbd_metrics.last_event_time, time);
+	STORE(wxkbd_metrics.last_event_ns, ns);
+}
+
+void
+metrics_startup(MetricsStartup milestone)
+{
+	uint64_t expected = 0;
+
+	__atomic_compare_exchange_n(&wxkbd_metrics.startup_ns[milestone], &expected, metrics_now(),
+	                            false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+uint64_t
+metrics_signature(void)
+{
+	uint64_t signature = FNV_OFFSET;
+	size_t i;
+
+	/* FNV-1a over whole values rather than a sum, in which a display
+	 * disconnecting while a counter goes up would cancel out. */
+	signature = (signature ^ (uint64_t) LOAD(wxkbd_metrics.displays)) * FNV_PRIME;
+	for (i = 0; i < METRICS_NCOUNTERS; i++) {
+		signature = (signature ^ LOAD(wxkbd_metrics.counters[i])) * FNV_PRIME;
+	}
+	for (i = 0; i < METRICS_NOPS; i++) {
+		signature = (signature ^ LOAD(wxkbd_metrics.ops[i].count)) * FNV_PRIME;
+	}
+	return signature;
+}
+
+void
+metrics_dump(FILE *f)
+{
+	const Histogram *h = &wxkbd_metrics.hotplug_latency;
+	uint64_t count, n, cumulative = 0;
+	size_t i;
+
+	for (i = 0; i < METRICS_NCOUNTERS; i++) {
+		fprintf(f, "%s %llu\n", counter_names[i],
+		        (unsigned long long) LOAD(wxkbd_metrics.counters[i]));
+	}
+
+	for (i = 0; i < METRICS_NOPS; i++) {
+		const OpCost *cost = &wxkbd_metrics.ops[i];
+
+		fprintf(f, "%s count=%llu requests=%llu roundtrips=%llu blocked_us=%llu max_roundtrips=%llu max_requests=%llu\n",
+		        op_names[i], (unsigned long long) LOAD(cost->count),
+		        (unsigned long long) LOAD(cost->requests),
+		        (unsigned long long) LOAD(cost->roundtrips),
+		        (unsigned long long) LOAD(cost->blocked_ns) / 1000,
+		        (unsigned long long) LOAD(cost->max_roundtrips),
+		        (unsigned long long) LOAD(cost->max_requests));
+	}
+
+	fprintf(f, "displays %d\n", LOAD(wxkbd_metrics.displays));
+	fprintf(f, "last_event_time %u\n", LOAD(wxkbd_metrics.last_event_time));
+	fprintf(f, "last_event_monotonic_ns %llu\n",
+	        (unsigned long long) LOAD(wxkbd_metrics.last_event_ns));
+	for (i = 0; i < METRICS_NSTARTUP; i++) {
+		fprintf(f, "startup_%s_monotonic_ns %llu\n", startup_names[i],
+		        (unsigned long long) LOAD(wxkbd_metrics.startup_ns[i]));
+	}
+
+	count = LOAD(h->count);
+	fprintf(f, "hotplug_latency_count %llu\n", (unsigned long long) count);
+	fprintf(f, "hotplug_latency_sum_us %llu\n", (unsigned long long) LOAD(h->sum));
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		if ((n = LOAD(h->buckets[i])) > 0) {
+			cumulative += n;
+			fprintf(f, "hotplug_latency_us{le=%llu} %llu\n",
+			        (unsigned long long) metrics_bucket_limit(i),
+			        (unsigned long long) cumulative);
+		}
+	}
+	fflush(f);
+}
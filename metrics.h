@@ -0,0 +1,117 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Process-wide counters and latency histograms. Updates are single relaxed
+ * atomic additions and never block, so they can be done from any thread in
+ * the hot path. */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Log-linear buckets: values below HISTOGRAM_SUB get a bucket each, above
+ * that every power of two is split into HISTOGRAM_SUB linear buckets. Values
+ * are in microseconds, the last bucket ends at about 71 minutes. */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((32 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+typedef enum MetricsCounter {
+	METRICS_EVENTS,                 /* events fed to wxkbd_handle_event() */
+	METRICS_HIERARCHY_EVENTS,
+	METRICS_XKB_EVENTS,
+	METRICS_APPLIES,                /* confirmed by the server */
+	METRICS_SKIPPED_APPLIES,        /* hierarchy events not needing one */
+	METRICS_ERRORS,                 /* X errors received */
+	METRICS_ROUNDTRIPS,             /* waits for a reply or request check */
+	METRICS_RECONNECTS,
+	METRICS_COLLAPSED_APPLIES,      /* folded into one already waiting */
+	METRICS_TIMEOUTS,               /* replies not received by their deadline */
+	METRICS_VERIFIES,               /* keyboards checked by wxkbd_verify() */
+	METRICS_DRIFTS,                 /* of those, found without the settings */
+	METRICS_NCOUNTERS
+} MetricsCounter;
+
+/* Operations whose X protocol cost is accounted separately */
+typedef enum MetricsOp {
+	METRICS_OP_STARTUP,             /* wxkbd_new() */
+	METRICS_OP_HOTPLUG,             /* handling a hierarchy event */
+	METRICS_OP_RECONNECT,           /* connection and setup after a loss */
+	METRICS_OP_RELOAD,              /* reapplying changed settings */
+	METRICS_OP_VERIFY,              /* checking the settings are still there */
+	METRICS_NOPS
+} MetricsOp;
+
+/* Milestones of the startup of the process */
+typedef enum MetricsStartup {
+	METRICS_STARTUP_MAIN,           /* main() entered, after dynamic linking */
+	METRICS_STARTUP_CONNECTED,      /* connection setup done */
+	METRICS_STARTUP_EXTENSIONS,     /* extensions queried, events selected */
+	METRICS_STARTUP_APPLIED,        /* first apply confirmed */
+	METRICS_NSTARTUP
+} MetricsStartup;
+
+typedef struct OpCost {
+	uint64_t count;
+	uint64_t requests;              /* sent */
+	uint64_t roundtrips;            /* replies or request checks waited on */
+	uint64_t blocked_ns;            /* time spent waiting */
+	uint64_t max_roundtrips;        /* of a single operation */
+	uint64_t max_requests;          /* of a single operation */
+} OpCost;
+
+typedef struct Histogram {
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+} Histogram;
+
+typedef struct Metrics {
+	uint64_t counters[METRICS_NCOUNTERS];
+	/* From the arrival of a hierarchy event to the confirmed apply */
+	Histogram hotplug_latency;
+	OpCost ops[METRICS_NOPS];
+	/* Server time and local arrival time of the last hierarchy event */
+	uint32_t last_event_time;
+	uint64_t last_event_ns;
+	int displays;                   /* connected X servers */
+	/* CLOCK_MONOTONIC when each milestone was first reached, 0 before */
+	uint64_t startup_ns[METRICS_NSTARTUP];
+} Metrics;
+
+extern Metrics wxkbd_metrics;
+
+/* CLOCK_MONOTONIC in nanoseconds */
+uint64_t metrics_now(void);
+const char *metrics_counter_name(MetricsCounter counter);
+const char *metrics_op_name(MetricsOp op);
+void metrics_count(MetricsCounter counter);
+void metrics_displays(int delta);
+/* Account the requests and round-trips of the calling thread to op until
+ * metrics_op_end(). Operations nest, everything counts towards the outermost
+ * one, e.g. the setup done by wxkbd_new() during a reconnect. */
+void metrics_op_begin(MetricsOp op);
+/* Like metrics_op_begin(), for the part of an operation that was held back,
+ * which is not counted as another one. */
+void metrics_op_resume(MetricsOp op);
+void metrics_op_end(void);
+void metrics_request(void);
+void metrics_roundtrip(uint64_t blocked_ns);
+/* Note the arrival of a hierarchy event with server time at ns */
+void metrics_event(uint32_t time, uint64_t ns);
+/* Note reaching milestone, only the first time counts */
+void metrics_startup(MetricsStartup milestone);
+void metrics_record(Histogram *histogram, uint64_t usec);
+/* Largest value in microseconds counted in bucket i */
+uint64_t metrics_bucket_limit(size_t i);
+/* Changes whenever a counter, an operation or the number of displays does,
+ * to tell whether there is anything new to export. */
+uint64_t metrics_signature(void);
+void metrics_dump(FILE *f);
+
+#endif /* METRICS_H */
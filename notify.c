@@ -0,0 +1,114 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "notify.h"
+
+struct Notify {
+	int fd;
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	uint64_t watchdog_ns;
+};
+
+static uint64_t watchdog_ns(void);
+
+/* $WATCHDOG_PID names the process meant, if set. */
+static uint64_t
+watchdog_ns(void)
+{
+	const char *usec = getenv("WATCHDOG_USEC"), *pid = getenv("WATCHDOG_PID");
+	unsigned long long value;
+	char *end;
+
+	if (usec == NULL || (pid != NULL && strtol(pid, NULL, 10) != (long) getpid())) {
+		return 0;
+	}
+	errno = 0;
+	value = strtoull(usec, &end, 10);
+	if (errno != 0 || *usec == '\0' || *end != '\0') {
+		fprintf(stderr, "Invalid WATCHDOG_USEC: %s\n", usec);
+		return 0;
+	}
+	return value * 1000;
+}
+
+Notify *
+notify_new(void)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	Notify *notify;
+	size_t len;
+
+	if (path == NULL || *path == '\0') {
+		return NULL;
+	}
+	if ((path[0] != '/' && path[0] != '@') || (len = strlen(path)) >= sizeof(notify->addr.sun_path)) {
+		fprintf(stderr, "Unsupported NOTIFY_SOCKET: %s\n", path);
+		return NULL;
+	}
+	if ((notify = calloc(1, sizeof(*notify))) == NULL) {
+		fprintf(stderr, "Cannot allocate memory.\n");
+		return NULL;
+	}
+	notify->addr.sun_family = AF_UNIX;
+	memcpy(notify->addr.sun_path, path, len);
+	/* An abstract socket, its name is not terminated. */
+	if (path[0] == '@') {
+		notify->addr.sun_path[0] = '\0';
+		notify->addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+	} else {
+		notify->addr_len = sizeof(notify->addr);
+	}
+
+	notify->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (notify->fd == -1 || fcntl(notify->fd, F_SETFD, FD_CLOEXEC) == -1
+	    || fcntl(notify->fd, F_SETFL, O_NONBLOCK) == -1) {
+		fprintf(stderr, "Cannot create notify socket: %s\n", strerror(errno));
+		if (notify->fd != -1) {
+			close(notify->fd);
+		}
+		free(notify);
+		return NULL;
+	}
+	notify->watchdog_ns = watchdog_ns();
+
+	return notify;
+}
+
+uint64_t
+notify_watchdog(const Notify *notify)
+{
+	return notify->watchdog_ns;
+}
+
+bool
+notify_send(Notify *notify, const char *state)
+{
+	if (sendto(notify->fd, state, strlen(state), MSG_NOSIGNAL,
+	           (struct sockaddr *) &notify->addr, notify->addr_len) == -1) {
+		fprintf(stderr, "Cannot notify service manager: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+void
+notify_free(Notify *notify)
+{
+	close(notify->fd);
+	free(notify);
+}
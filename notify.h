@@ -0,0 +1,26 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Service manager notifications as systemd's sd_notify() sends them, without
+ * libsystemd: datagrams like "READY=1" to the socket in $NOTIFY_SOCKET. */
+
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct Notify Notify;
+
+/* Returns NULL if $NOTIFY_SOCKET is not set, or on failure. */
+Notify *notify_new(void);
+/* Interval in nanoseconds from $WATCHDOG_USEC within which WATCHDOG=1 is
+ * expected, 0 if the watchdog is not enabled for this process. */
+uint64_t notify_watchdog(const Notify *notify);
+/* Send state, e.g. "READY=1". Never blocks, safe from any thread. */
+bool notify_send(Notify *notify, const char *state);
+void notify_free(Notify *notify);
+
+#endif /* NOTIFY_H */
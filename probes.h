@@ -0,0 +1,28 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Static USDT tracepoints in the provider "wxkbd", compatible with SystemTap,
+ * bpftrace and perf. A probe site is a single nop until a tracer attaches.
+ * Without HAVE_SDT (see USDT in the Makefile) they compile to nothing.
+ *
+ *     $ bpftrace -e 'usdt:./wxkbd:wxkbd:request { printf("%d\n", arg0); }'
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(wxkbd, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(wxkbd, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(wxkbd, name, a, b, c)
+#else
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif /* PROBES_H */
@@ -0,0 +1,62 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "recorder.h"
+#include "metrics.h"
+
+typedef struct Record {
+	uint64_t ns;
+	uint32_t kind;
+	uint32_t args[4];
+} Record;
+
+static Record records[RECORDER_SIZE];
+static uint32_t next;
+
+static const char *formats[RECORD_NKINDS] = {
+	[RECORD_EVENT] = "event type=%u extension=%u event_type=%u sequence=%u",
+	[RECORD_DEVICE] = "device id=%u attachment=%u type=%u flags=%#x",
+	[RECORD_REQUEST] = "request sequence=%u major=%u minor=%u device=%u",
+	[RECORD_REPLY] = "reply sequence=%u",
+	[RECORD_ERROR] = "error sequence=%u code=%u major=%u minor=%u",
+	[RECORD_CONNECT] = "connect",
+	[RECORD_DISCONNECT] = "disconnect",
+};
+
+void
+recorder_record(RecordKind kind, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+	Record *r = &records[__atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % RECORDER_SIZE];
+
+	r->ns = metrics_now();
+	r->kind = kind;
+	r->args[0] = a;
+	r->args[1] = b;
+	r->args[2] = c;
+	r->args[3] = d;
+}
+
+void
+recorder_dump(FILE *f)
+{
+	uint32_t end = __atomic_load_n(&next, __ATOMIC_RELAXED);
+	uint32_t i = (end > RECORDER_SIZE) ? end - RECORDER_SIZE : 0;
+	uint64_t now = metrics_now();
+	const Record *r;
+
+	fprintf(f, "flight recorder: %u entries, now %llu.%09llu\n", end - i,
+	        (unsigned long long) (now / 1000000000), (unsigned long long) (now % 1000000000));
+	for (; i != end; i++) {
+		r = &records[i % RECORDER_SIZE];
+		fprintf(f, "%llu.%09llu ", (unsigned long long) (r->ns / 1000000000),
+		        (unsigned long long) (r->ns % 1000000000));
+		fprintf(f, formats[r->kind], r->args[0], r->args[1], r->args[2], r->args[3]);
+		fputc('\n', f);
+	}
+	fflush(f);
+}
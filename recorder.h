@@ -0,0 +1,35 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Flight recorder: a fixed-size ring buffer of the most recent X events,
+ * device changes, requests, replies and errors. Recording takes a timestamp,
+ * an atomic increment and a few stores, nothing is allocated, so it is always
+ * on. The buffer is only read when dumped. */
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Number of entries kept, a power of two */
+#define RECORDER_SIZE 1024
+
+typedef enum RecordKind {
+	RECORD_EVENT,           /* response type, extension, event type, sequence */
+	RECORD_DEVICE,          /* device, attachment, type, hierarchy flags */
+	RECORD_REQUEST,         /* sequence, major opcode, minor opcode, device */
+	RECORD_REPLY,           /* sequence */
+	RECORD_ERROR,           /* sequence, error code, major opcode, minor opcode */
+	RECORD_CONNECT,
+	RECORD_DISCONNECT,
+	RECORD_NKINDS
+} RecordKind;
+
+void recorder_record(RecordKind kind, uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+/* Write the recorded entries to f, oldest first. */
+void recorder_dump(FILE *f);
+
+#endif /* RECORDER_H */
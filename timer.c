@@ -0,0 +1,308 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+
+#include "timer.h"
+#include "metrics.h"
+
+#define NSEC_PER_TICK 1000000ULL
+#define SLOT_BITS 6
+#define SLOTS (1 << SLOT_BITS)
+#define SLOT_MASK (SLOTS - 1)
+/* Every level spans 8 times the time of the one below */
+#define LEVEL_SHIFT 3
+#define SHIFT(level) ((level) * LEVEL_SHIFT)
+
+/* Values of Timer.level outside the wheel */
+#define LEVEL_NONE 0xff
+#define LEVEL_EXPIRED 0xfe
+#define LEVEL_LAZY 0xfd
+
+struct Timers {
+	int fd;
+	uint64_t clock;                 /* last tick run */
+	uint64_t armed;                 /* tick the timerfd is armed for, 0 if none */
+	Timer *slots[TIMER_LEVELS][SLOTS];
+	uint64_t pending[TIMER_LEVELS]; /* bit per non-empty slot */
+	Timer *lazy;                    /* lazy timers, never many */
+	Timer *expired;                 /* about to run in timers_run() */
+};
+
+static Timer **list_of(Timers *timers, const Timer *timer);
+static void link_timer(Timer **list, Timer *timer);
+static void unlink_timer(Timers *timers, Timer *timer);
+static void place(Timers *timers, Timer *timer);
+static uint64_t next_tick(const Timers *timers);
+
+static Timer **
+list_of(Timers *timers, const Timer *timer)
+{
+	switch (timer->level) {
+	case LEVEL_EXPIRED:
+		return &timers->expired;
+	case LEVEL_LAZY:
+		return &timers->lazy;
+	default:
+		return &timers->slots[timer->level][timer->slot];
+	}
+}
+
+static void
+link_timer(Timer **list, Timer *timer)
+{
+	timer->prev = NULL;
+	timer->next = *list;
+	if (*list != NULL) {
+		(*list)->prev = timer;
+	}
+	*list = timer;
+}
+
+static void
+unlink_timer(Timers *timers, Timer *timer)
+{
+	Timer **list = list_of(timers, timer);
+
+	if (timer->prev != NULL) {
+		timer->prev->next = timer->next;
+	} else {
+		*list = timer->next;
+	}
+	if (timer->next != NULL) {
+		timer->next->prev = timer->prev;
+	}
+	if (*list == NULL && timer->level < TIMER_LEVELS) {
+		timers->pending[timer->level] &= ~(1ULL << timer->slot);
+	}
+	timer->level = LEVEL_NONE;
+}
+
+/* Put timer into the lowest level whose 64 slots ahead of the clock reach its
+ * expiry, into the slot that ends at or after it. Timers beyond the last level
+ * go into its last slot and are placed again once that expires. */
+static void
+place(Timers *timers, Timer *timer)
+{
+	uint64_t tick = (timer->expires + NSEC_PER_TICK - 1) / NSEC_PER_TICK;
+	uint64_t index = 0;
+	unsigned int level;
+
+	if (tick <= timers->clock) {
+		tick = timers->clock + 1;
+	}
+	for (level = 0; level < TIMER_LEVELS; level++) {
+		index = (tick + (1ULL << SHIFT(level)) - 1) >> SHIFT(level);
+		if (index - (timers->clock >> SHIFT(level)) < SLOTS) {
+			break;
+		}
+	}
+	if (level == TIMER_LEVELS) {
+		level = TIMER_LEVELS - 1;
+		index = (timers->clock >> SHIFT(level)) + SLOTS - 1;
+	}
+
+	timer->level = level;
+	timer->slot = index & SLOT_MASK;
+	link_timer(&timers->slots[level][timer->slot], timer);
+	timers->pending[level] |= 1ULL << timer->slot;
+}
+
+/* The first tick at which a slot with timers ends or a lazy timer has to
+ * run, 0 if there is none. */
+static uint64_t
+next_tick(const Timers *timers)
+{
+	uint64_t next = 0, base, bits, tick;
+	unsigned int level, rotate;
+	const Timer *timer;
+
+	for (timer = timers->lazy; timer != NULL; timer = timer->next) {
+		tick = (timer->latest + NSEC_PER_TICK - 1) / NSEC_PER_TICK;
+		if (next == 0 || tick < next) {
+			next = tick;
+		}
+	}
+
+	for (level = 0; level < TIMER_LEVELS; level++) {
+		if (timers->pending[level] == 0) {
+			continue;
+		}
+		/* Slots ahead of the clock, rotated to start at the next one */
+		base = timers->clock >> SHIFT(level);
+		rotate = (base + 1) & SLOT_MASK;
+		bits = timers->pending[level];
+		if (rotate != 0) {
+			bits = (bits >> rotate) | (bits << (SLOTS - rotate));
+		}
+		tick = (base + 1 + __builtin_ctzll(bits)) << SHIFT(level);
+		if (next == 0 || tick < next) {
+			next = tick;
+		}
+	}
+
+	return next;
+}
+
+Timers *
+timers_new(void)
+{
+	Timers *timers;
+
+	if ((timers = calloc(1, sizeof(*timers))) == NULL) {
+		fprintf(stderr, "Cannot allocate memory.\n");
+		return NULL;
+	}
+	if ((timers->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+		fprintf(stderr, "Cannot create timerfd: %s\n", strerror(errno));
+		free(timers);
+		return NULL;
+	}
+	timers->clock = metrics_now() / NSEC_PER_TICK;
+
+	return timers;
+}
+
+int
+timers_fd(const Timers *timers)
+{
+	return timers->fd;
+}
+
+void
+timers_run(Timers *timers)
+{
+	uint64_t expirations, now = metrics_now(), tick = now / NSEC_PER_TICK;
+	uint64_t from, to, i;
+	unsigned int level;
+	Timer *timer, *next, **slot;
+
+	/* Only clears the readiness, the clock tells what is due. */
+	if (timers->armed != 0 && timers->armed <= tick) {
+		if (read(timers->fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+			fprintf(stderr, "Cannot read timerfd: %s\n", strerror(errno));
+		}
+		timers->armed = 0;
+	}
+
+	for (timer = timers->lazy; timer != NULL; timer = next) {
+		next = timer->next;
+		if (timer->expires <= now) {
+			unlink_timer(timers, timer);
+			timer->level = LEVEL_EXPIRED;
+			link_timer(&timers->expired, timer);
+		}
+	}
+
+	/* Slots passed since the last run, at most all of a level */
+	for (level = 0; level < TIMER_LEVELS && tick > timers->clock; level++) {
+		from = timers->clock >> SHIFT(level);
+		to = tick >> SHIFT(level);
+		if (to - from > SLOTS) {
+			to = from + SLOTS;
+		}
+		for (i = from + 1; i <= to; i++) {
+			slot = &timers->slots[level][i & SLOT_MASK];
+			while ((timer = *slot) != NULL) {
+				unlink_timer(timers, timer);
+				timer->level = LEVEL_EXPIRED;
+				link_timer(&timers->expired, timer);
+			}
+		}
+	}
+	if (tick > timers->clock) {
+		timers->clock = tick;
+	}
+
+	while ((timer = timers->expired) != NULL) {
+		unlink_timer(timers, timer);
+		if (timer->expires > now) {
+			place(timers, timer);
+			continue;
+		}
+		timer->func(timer, timer->data);
+	}
+}
+
+void
+timers_arm(Timers *timers)
+{
+	struct itimerspec its;
+	uint64_t tick = next_tick(timers), ns;
+
+	if (tick == timers->armed) {
+		return;
+	}
+
+	/* A zero it_value disarms the timerfd. */
+	memset(&its, 0, sizeof(its));
+	ns = tick * NSEC_PER_TICK;
+	its.it_value.tv_sec = ns / 1000000000ULL;
+	its.it_value.tv_nsec = ns % 1000000000ULL;
+	if (timerfd_settime(timers->fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+		fprintf(stderr, "Cannot arm timerfd: %s\n", strerror(errno));
+		return;
+	}
+	timers->armed = tick;
+}
+
+void
+timers_free(Timers *timers)
+{
+	close(timers->fd);
+	free(timers);
+}
+
+void
+timer_init(Timer *timer, TimerFunc func, void *data)
+{
+	memset(timer, 0, sizeof(*timer));
+	timer->level = LEVEL_NONE;
+	timer->func = func;
+	timer->data = data;
+}
+
+void
+timer_add(Timers *timers, Timer *timer, uint64_t expires)
+{
+	if (timer_pending(timer)) {
+		unlink_timer(timers, timer);
+	}
+	timer->expires = expires;
+	place(timers, timer);
+}
+
+void
+timer_add_lazy(Timers *timers, Timer *timer, uint64_t earliest, uint64_t latest)
+{
+	if (timer_pending(timer)) {
+		unlink_timer(timers, timer);
+	}
+	timer->expires = earliest;
+	timer->latest = latest;
+	timer->level = LEVEL_LAZY;
+	link_timer(&timers->lazy, timer);
+}
+
+void
+timer_cancel(Timers *timers, Timer *timer)
+{
+	if (timer_pending(timer)) {
+		unlink_timer(timers, timer);
+	}
+}
+
+bool
+timer_pending(const Timer *timer)
+{
+	return timer->level != LEVEL_NONE;
+}
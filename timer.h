@@ -0,0 +1,70 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Timers: a hierarchical timer wheel behind a single timerfd.
+ *
+ * The wheel has TIMER_LEVELS levels of 64 slots. A slot of level 0 spans one
+ * tick of 1 ms, every level above spans 8 times as many, so that timers further
+ * out are kept with less precision: a timer due in d fires at most d/8 late,
+ * and never early. Adding and cancelling a timer is O(1), running the expired
+ * ones and finding the next expiry O(TIMER_LEVELS), however long the loop
+ * slept.
+ *
+ * The timerfd is armed for the earliest timer only, and disarmed while no
+ * timer is pending, so that an idle loop is not woken up.
+ *
+ * Periodic work that may slip is added with timer_add_lazy(): it runs at the
+ * first wakeup after its earliest time, for whatever reason the loop woke up,
+ * and only wakes the loop itself once its latest time has come.
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TIMER_LEVELS 7
+
+typedef struct Timer Timer;
+typedef struct Timers Timers;
+
+typedef void (*TimerFunc)(Timer *timer, void *data);
+
+/* Embedded by its owner, initialize with timer_init() before use. */
+struct Timer {
+	Timer *next;
+	Timer *prev;
+	uint64_t expires;       /* CLOCK_MONOTONIC in nanoseconds */
+	uint64_t latest;        /* of lazy timers */
+	uint8_t level;
+	uint8_t slot;
+	TimerFunc func;
+	void *data;
+};
+
+/* Create the wheel and its timerfd. Returns NULL on failure. */
+Timers *timers_new(void);
+/* The timerfd, readable when timers are due. */
+int timers_fd(const Timers *timers);
+/* Run the expired timers and the lazy ones past their earliest time. Their
+ * functions may add and cancel timers. Call on every wakeup, so that lazy
+ * timers are run together with other work. */
+void timers_run(Timers *timers);
+/* Program the timerfd for the earliest pending timer. Call before waiting. */
+void timers_arm(Timers *timers);
+void timers_free(Timers *timers);
+
+void timer_init(Timer *timer, TimerFunc func, void *data);
+/* Schedule timer to run func(timer, data) at expires, rescheduling it if it
+ * is pending already. */
+void timer_add(Timers *timers, Timer *timer, uint64_t expires);
+/* Schedule timer to run at the first wakeup after earliest, waking up the
+ * loop for it at latest. */
+void timer_add_lazy(Timers *timers, Timer *timer, uint64_t earliest, uint64_t latest);
+void timer_cancel(Timers *timers, Timer *timer);
+bool timer_pending(const Timer *timer);
+
+#endif /* TIMER_H */
@@ -0,0 +1,202 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include <xcb/xcb.h>
+
+#include "xcbmin.h"
+#include "trace.h"
+#include "metrics.h"
+
+#define TRACE_MAGIC "WXKT"
+#define TRACE_VERSION 1
+
+/* Events are 32 bytes on the wire, generic events carry length 4 byte units
+ * more, which xcb stores after full_sequence. */
+#define EVENT_SIZE 32
+#define EVENT_HEAD offsetof(xcb_ge_generic_event_t, full_sequence)
+#define MAX_EVENT (1 << 18)
+
+struct Trace {
+	FILE *f;
+	uint64_t start;
+	/* The opcodes of the recording connection */
+	uint8_t xinput_opcode;
+	uint8_t xkb_event;
+	/* When replaying, the opcodes of the replaying connection */
+	uint8_t replay_xinput_opcode;
+	uint8_t replay_xkb_event;
+};
+
+static char byte_order(void);
+static Trace *trace_new(const char *path, const char *mode);
+
+static char
+byte_order(void)
+{
+	const uint16_t one = 1;
+
+	return (*(const uint8_t *) &one == 1) ? 'l' : 'B';
+}
+
+static Trace *
+trace_new(const char *path, const char *mode)
+{
+	Trace *trace;
+
+	if ((trace = calloc(1, sizeof(*trace))) == NULL) {
+		fprintf(stderr, "Cannot allocate memory.\n");
+		return NULL;
+	}
+	if ((trace->f = fopen(path, mode)) == NULL) {
+		fprintf(stderr, "Cannot open trace %s: %s\n", path, strerror(errno));
+		free(trace);
+		return NULL;
+	}
+
+	return trace;
+}
+
+Trace *
+trace_create(const char *path, uint8_t xinput_opcode, uint8_t xkb_event)
+{
+	Trace *trace;
+	uint8_t header[8] = TRACE_MAGIC;
+
+	if ((trace = trace_new(path, "wb")) == NULL) {
+		return NULL;
+	}
+	trace->start = metrics_now();
+	trace->xinput_opcode = xinput_opcode;
+	trace->xkb_event = xkb_event;
+
+	header[4] = TRACE_VERSION;
+	header[5] = byte_order();
+	header[6] = xinput_opcode;
+	header[7] = xkb_event;
+	if (fwrite(header, sizeof(header), 1, trace->f) != 1 || fflush(trace->f) != 0) {
+		fprintf(stderr, "Cannot write trace %s: %s\n", path, strerror(errno));
+		trace_close(trace);
+		return NULL;
+	}
+
+	return trace;
+}
+
+Trace *
+trace_open(const char *path, uint8_t xinput_opcode, uint8_t xkb_event)
+{
+	Trace *trace;
+	uint8_t header[8];
+
+	if ((trace = trace_new(path, "rb")) == NULL) {
+		return NULL;
+	}
+	if (fread(header, sizeof(header), 1, trace->f) != 1
+	    || memcmp(header, TRACE_MAGIC, 4) != 0
+	    || header[4] != TRACE_VERSION) {
+		fprintf(stderr, "%s is not a trace.\n", path);
+		trace_close(trace);
+		return NULL;
+	}
+	if (header[5] != byte_order()) {
+		fprintf(stderr, "Trace %s was recorded on a host of different byte order.\n", path);
+		trace_close(trace);
+		return NULL;
+	}
+	trace->xinput_opcode = header[6];
+	trace->xkb_event = header[7];
+	trace->replay_xinput_opcode = xinput_opcode;
+	trace->replay_xkb_event = xkb_event;
+
+	return trace;
+}
+
+bool
+trace_write(Trace *trace, const xcb_generic_event_t *event)
+{
+	const xcb_ge_generic_event_t *generic_event = (const xcb_ge_generic_event_t *) event;
+	uint64_t ns;
+	uint32_t len = EVENT_SIZE;
+
+	if (XCB_EVENT_RESPONSE_TYPE(event) == XCB_GE_GENERIC) {
+		if (generic_event->extension != trace->xinput_opcode) {
+			return true;
+		}
+		len += generic_event->length * 4;
+	} else if (XCB_EVENT_RESPONSE_TYPE(event) != trace->xkb_event) {
+		return true;
+	}
+
+	ns = metrics_now() - trace->start;
+	if (fwrite(&ns, sizeof(ns), 1, trace->f) != 1
+	    || fwrite(&len, sizeof(len), 1, trace->f) != 1
+	    || fwrite(event, EVENT_SIZE, 1, trace->f) != 1
+	    || (len > EVENT_SIZE
+	        && fwrite((const uint8_t *) event + EVENT_HEAD + 4, len - EVENT_SIZE, 1, trace->f) != 1)
+	    || fflush(trace->f) != 0) {
+		fprintf(stderr, "Cannot write trace: %s\n", strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+xcb_generic_event_t *
+trace_read(Trace *trace, uint64_t *ns)
+{
+	xcb_generic_event_t *event;
+	xcb_ge_generic_event_t *generic_event;
+	uint32_t len;
+
+	if (fread(ns, sizeof(*ns), 1, trace->f) != 1) {
+		return NULL;
+	}
+	if (fread(&len, sizeof(len), 1, trace->f) != 1 || len < EVENT_SIZE || len > MAX_EVENT) {
+		fprintf(stderr, "Truncated or corrupt trace.\n");
+		return NULL;
+	}
+	/* Leave room for full_sequence like xcb does, also for 32 byte events. */
+	if ((event = malloc(len + 4)) == NULL) {
+		fprintf(stderr, "Cannot allocate memory.\n");
+		return NULL;
+	}
+	generic_event = (xcb_ge_generic_event_t *) event;
+	if (fread(event, EVENT_SIZE, 1, trace->f) != 1
+	    || (len > EVENT_SIZE
+	        && fread((uint8_t *) event + EVENT_HEAD + 4, len - EVENT_SIZE, 1, trace->f) != 1)) {
+		fprintf(stderr, "Truncated trace.\n");
+		free(event);
+		return NULL;
+	}
+	if (len != EVENT_SIZE + ((XCB_EVENT_RESPONSE_TYPE(event) == XCB_GE_GENERIC) ? generic_event->length * 4 : 0)) {
+		fprintf(stderr, "Corrupt trace.\n");
+		free(event);
+		return NULL;
+	}
+	event->full_sequence = event->sequence;
+
+	if (XCB_EVENT_RESPONSE_TYPE(event) == XCB_GE_GENERIC) {
+		generic_event->extension = trace->replay_xinput_opcode;
+	} else {
+		event->response_type += trace->replay_xkb_event - trace->xkb_event;
+	}
+
+	return event;
+}
+
+void
+trace_close(Trace *trace)
+{
+	fclose(trace->f);
+	free(trace);
+}
@@ -0,0 +1,46 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Event traces: XInput and XKB events as received from the server, recorded
+ * to a binary file for replaying them into the engine later.
+ *
+ * A trace starts with an 8 byte header: the magic "WXKT", the format version,
+ * the byte order of the recording host ('l' or 'B', as in the X connection
+ * setup), the XInput major opcode and the XKB event code of the recording
+ * connection. Every event follows as the monotonic time in nanoseconds since
+ * the trace was created (uint64_t), the length of the event (uint32_t) and the
+ * event in its wire format, i.e. without the full_sequence xcb inserts.
+ *
+ * Events are replayed with the opcodes of the replaying connection, so traces
+ * from one server can be fed to any other, but only on hosts of the same byte
+ * order.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <xcb/xcb.h>
+
+typedef struct Trace Trace;
+
+/* Create a trace at path for events of a connection with the given XInput
+ * major opcode and XKB event code. Returns NULL on failure. */
+Trace *trace_create(const char *path, uint8_t xinput_opcode, uint8_t xkb_event);
+/* Open the trace at path for replaying its events to a connection with the
+ * given XInput major opcode and XKB event code. Returns NULL on failure. */
+Trace *trace_open(const char *path, uint8_t xinput_opcode, uint8_t xkb_event);
+/* Append event if it is an XInput or XKB event, other events are ignored.
+ * Returns false if the trace cannot be written. */
+bool trace_write(Trace *trace, const xcb_generic_event_t *event);
+/* Read the next event, laid out as returned by xcb_poll_for_event(), and the
+ * time it was recorded at in *ns. Returns NULL at the end of the trace or on
+ * failure. The event has to be freed. */
+xcb_generic_event_t *trace_read(Trace *trace, uint64_t *ns);
+void trace_close(Trace *trace);
+
+#endif /* TRACE_H */
@@ -12,88 +12,834 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <xcb/xcb.h>
-#include <xcb/xcbext.h>
-#include <xcb/xcb_event.h>
-#include <xcb/xinput.h>
-#include <xcb/xkb.h>
+
+#include "xcbmin.h"
+#include "wxkbd.h"
+#include "bus.h"
+#include "metrics.h"
+#include "export.h"
+#include "recorder.h"
+#include "trace.h"
+#include "timer.h"
+#include "arena.h"
+#include "notify.h"
+#include "probes.h"
 
 #define ARR_LEN(x) (sizeof(x)/sizeof((x)[0]))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+
+/* Seconds to wait before reconnecting, doubled on every failed attempt */
+#define RECONNECT_MIN 1
+#define RECONNECT_MAX 60
+
+/* Memory of a display that lives as long as its connection: the state of
+ * wxkbd, see wxkbd_size() */
+#define DISPLAY_ARENA_SIZE 4096
+
+typedef struct Worker Worker;
+
+/* Settings, shared read-only by all displays */
+typedef struct Config {
+	uint16_t rate;
+	uint16_t delay;
+	uint16_t debounce;
+	uint16_t verify;        /* seconds between checks, 0 for none */
+} Config;
+
+typedef struct Display {
+	const char *name;       /* NULL for $DISPLAY */
+	const Config *config;
+	Arena arena;            /* reset on disconnect */
+	xcb_connection_t *connection;
+	Wxkbd *wxkbd;
+	Trace *trace;
+	Worker *worker;
+	Timer reconnect;
+	Timer deadline;         /* of wxkbd, see wxkbd_deadline() */
+	Timer verify;           /* see wxkbd_verify() */
+	unsigned int seed;      /* of the jitter of verify */
+	unsigned int backoff;
+	bool reloading;         /* reapplying new settings, see worker_reload() */
+	unsigned int reload_generation; /* of the settings reapplied */
+	bool starting;          /* first settings not confirmed yet */
+	struct Display *next;   /* in the intake of the worker */
+} Display;
+
+/* Serves the displays assigned to it from a thread with its own epoll
+ * instance and timers. Nothing in it is shared with other workers; the main
+ * thread only pushes new displays to the intake, reads the load and wakes it
+ * up for new settings. */
+struct Worker {
+	pthread_t thread;
+	Config config;          /* shared read-only by its displays */
+	unsigned int generation; /* of config */
+	int epoll_fd;
+	int wake_fd;            /* eventfd, for the intake and for stopping */
+	Timers *timers;
+	Display *intake;        /* lock-free stack, see worker_add() */
+	bool stop;
+	uint64_t load;          /* events handled, halved every second */
+	uint64_t load_at;
+	unsigned int assigned;  /* displays, only used by the main thread */
+	unsigned int watchdog;  /* last round of the watchdog seen */
+};
+
+typedef struct Watchdog {
+	Timer timer;
+	Worker *workers;
+	size_t nworkers;
+	uint64_t interval;      /* within which the service manager expects a ping */
+} Watchdog;
 
 const uint16_t default_rate = 70;
 const uint16_t default_delay = 250;
+const uint16_t default_export_interval = 15;
 
-typedef struct InputEventMask {
-	xcb_input_event_mask_t info;
-	xcb_input_xi_event_mask_t mask;
-} InputEventMask;
+/* The settings as last read, taken over by the workers under config_lock */
+static Config config;
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int config_generation;
+static const char *config_path;
+/* Of the last generation only, under config_lock: the displays still
+ * reapplying it, plus one for each worker yet to take it over. A newer
+ * generation starts over, so that a worker skipping one does not leave its
+ * token behind. */
+static uint64_t reload_start;
+static unsigned int reloading;
+/* Displays yet to confirm their first settings, READY=1 is sent at 0 */
+static unsigned int starting;
+static Notify *notify;
+static unsigned int watchdog_round;
+static uint16_t export_interval;
+static const char *export_path;
+static uint64_t exported_at, exported_signature;
+static bool export_wanted;
+static uint16_t budget;
+static int epoll_fd, wake_fd;
+static Timers *timers;
+static Bus *bus;
+static const char *trace_path;
+static volatile sig_atomic_t dump_metrics;
+static volatile sig_atomic_t dump_recorder;
+static volatile sig_atomic_t reload;
+static volatile sig_atomic_t running = 1;
+/* Set by a worker that cannot go on, for the main thread to exit */
+static bool failed;
 
-static bool is_hierarchy_event(const xcb_generic_event_t *event, const xcb_query_extension_reply_t *xinput_info);
-static bool set_repeat_rate_and_delay(xcb_connection_t *connection, uint16_t rate, uint16_t delay);
+static bool display_connect(Display *display);
+static void display_disconnect(Display *display);
+static void display_dispatch(Display *display);
+static void display_handle_event(Display *display, xcb_generic_event_t *event);
+static void display_update(Display *display);
+static void display_reloaded(Display *display);
+static void display_started(Display *display);
+static void display_schedule_verify(Display *display);
+static bool worker_start(Worker *worker);
+static void *worker_run(void *data);
+static void worker_add(Worker *worker, Display *display);
+static void worker_account(Worker *worker, uint64_t events);
+static uint64_t worker_load(const Worker *worker, uint64_t now);
+static Worker *least_loaded(Worker *workers, size_t nworkers);
+static void worker_reload(Worker *worker, Display *displays);
+static void worker_fail(Worker *worker, char *fmt, ...);
+static void reload_done(unsigned int generation, unsigned int started, unsigned int done);
+static bool read_config(const char *path, Config *config);
+static void publish_config(const Config *base, Worker *workers, size_t nworkers);
+static void on_reconnect(Timer *timer, void *data);
+static void on_deadline(Timer *timer, void *data);
+static void on_verify(Timer *timer, void *data);
+static void on_export(Timer *timer, void *data);
+static void on_watchdog(Timer *timer, void *data);
+static void wake(int fd);
+static bool watch(int epoll_fd, int fd, void *ptr);
+static void on_signal(int sig);
+static void write_recorder(const char *path);
+static void publish_device(const WxkbdDevice *device, void *data);
+static int apply_once(const char **names, size_t ndisplays);
 static bool str_to_uint16(const char *str, uint16_t *res);
 static void usage(char *progname, int exit_code);
 static void version(void);
 static void err(char *fmt, ...);
 
 static bool
-is_hierarchy_event(const xcb_generic_event_t *event, const xcb_query_extension_reply_t *xinput_info)
+display_connect(Display *display)
 {
-	if (XCB_EVENT_RESPONSE_TYPE(event) != XCB_GE_GENERIC) {
-		return false;
+	Worker *worker = display->worker;
+	const Config *config = display->config;
+	const char *path;
+	void *mem;
+	uint64_t start;
+
+	/* The connection setup is a round-trip of its own. */
+	start = metrics_now();
+	display->connection = xcb_connect(display->name, NULL);
+	metrics_request();
+	metrics_roundtrip(metrics_now() - start);
+	if (xcb_connection_has_error(display->connection)) {
+		fprintf(stderr, "Cannot connect to server %s.\n",
+		        (display->name != NULL) ? display->name : "");
+		goto fail;
 	}
+	metrics_startup(METRICS_STARTUP_CONNECTED);
 
-	xcb_ge_generic_event_t *generic_event = (xcb_ge_generic_event_t *) event;
-	if (generic_event->extension != xinput_info->major_opcode
-	    || generic_event->event_type != XCB_INPUT_HIERARCHY) {
-		return false;
+	if ((mem = arena_alloc(&display->arena, wxkbd_size())) == NULL
+	    || (display->wxkbd = wxkbd_new_in(mem, display->connection, config->rate, config->delay)) == NULL) {
+		goto fail;
+	}
+	wxkbd_set_debounce(display->wxkbd, config->debounce);
+	wxkbd_set_verify_on_change(display->wxkbd, config->verify > 0);
+	if (bus != NULL) {
+		wxkbd_set_device_func(display->wxkbd, publish_device, display);
+	}
+	/* The first display to connect records the trace. The extension data
+	 * is cached by now, this is not a round-trip. */
+	if (display->trace == NULL && (path = __atomic_exchange_n(&trace_path, NULL, __ATOMIC_RELAXED)) != NULL) {
+		display->trace = trace_create(path,
+		                              xcb_get_extension_data(display->connection, &xcb_input_id)->major_opcode,
+		                              xcb_get_extension_data(display->connection, &xcb_xkb_id)->first_event);
+		if (display->trace == NULL) {
+			wxkbd_free(display->wxkbd);
+			goto fail;
+		}
 	}
 
-	xcb_input_hierarchy_event_t *hierarchy_event = (xcb_input_hierarchy_event_t *) generic_event;
-	if (!(hierarchy_event->flags & (XCB_INPUT_HIERARCHY_MASK_MASTER_ADDED | XCB_INPUT_HIERARCHY_MASK_SLAVE_ADDED))) {
-		return false;
+	if (!watch(worker->epoll_fd, xcb_get_file_descriptor(display->connection), display)) {
+		wxkbd_free(display->wxkbd);
+		goto fail;
 	}
+	recorder_record(RECORD_CONNECT, 0, 0, 0, 0);
+	metrics_displays(1);
+	return true;
+
+fail:
+	xcb_disconnect(display->connection);
+	display->connection = NULL;
+	arena_reset(&display->arena);
+	return false;
+}
+
+static void
+display_disconnect(Display *display)
+{
+	Worker *worker = display->worker;
+
+	epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, xcb_get_file_descriptor(display->connection), NULL);
+	timer_cancel(worker->timers, &display->deadline);
+	timer_cancel(worker->timers, &display->verify);
+	wxkbd_free(display->wxkbd);
+	xcb_flush(display->connection);
+	xcb_disconnect(display->connection);
+	arena_reset(&display->arena);
+	display->wxkbd = NULL;
+	display->connection = NULL;
+	recorder_record(RECORD_DISCONNECT, 0, 0, 0, 0);
+	metrics_displays(-1);
+}
+
+static void
+display_dispatch(Display *display)
+{
+	xcb_generic_event_t *event;
+	uint64_t events = 0;
 
+	while ((event = xcb_poll_for_event(display->connection)) != NULL) {
+		display_handle_event(display, event);
+		events++;
+	}
+	wxkbd_handle_replies(display->wxkbd);
+	/* Collecting the replies may have read further events. */
+	while ((event = xcb_poll_for_queued_event(display->connection)) != NULL) {
+		display_handle_event(display, event);
+		events++;
+	}
+	worker_account(display->worker, events);
+}
+
+static void
+display_handle_event(Display *display, xcb_generic_event_t *event)
+{
+	if (display->trace != NULL && !trace_write(display->trace, event)) {
+		trace_close(display->trace);
+		display->trace = NULL;
+	}
+	wxkbd_handle_event(display->wxkbd, event);
+	free(event);
+}
+
+/* After dispatching: reconnect if the connection was lost, wake up for the
+ * next deadline of wxkbd and verification otherwise, and have the metrics
+ * exported if they changed. */
+static void
+display_update(Display *display)
+{
+	Timers *timers = display->worker->timers;
+	uint64_t deadline;
+
+	/* In benchmarks and tests, a hotplug needing more requests than
+	 * budgeted is fatal. */
+	if (budget > 0 && LOAD(wxkbd_metrics.ops[METRICS_OP_HOTPLUG].max_requests) > budget) {
+		metrics_dump(stderr);
+		worker_fail(display->worker, "Hotplug request budget of %u exceeded.\n", budget);
+		return;
+	}
+	if (xcb_connection_has_error(display->connection)) {
+		fprintf(stderr, "Lost connection to server %s.\n",
+		        (display->name != NULL) ? display->name : "");
+		display_disconnect(display);
+		timer_add(timers, &display->reconnect, metrics_now() + display->backoff * NSEC_PER_SEC);
+	} else if ((deadline = wxkbd_deadline(display->wxkbd)) != 0) {
+		timer_add(timers, &display->deadline, deadline);
+	} else {
+		timer_cancel(timers, &display->deadline);
+	}
+	if (display->connection == NULL || display->config->verify == 0) {
+		timer_cancel(timers, &display->verify);
+	} else if (!timer_pending(&display->verify)) {
+		display_schedule_verify(display);
+	}
+	if (display->reloading && (display->connection == NULL || wxkbd_pending(display->wxkbd) == 0)) {
+		display_reloaded(display);
+	}
+	if (display->starting && display->connection != NULL && wxkbd_pending(display->wxkbd) == 0
+	    && wxkbd_applied(display->wxkbd)) {
+		display_started(display);
+	}
+
+	if (export_path != NULL && !LOAD(export_wanted)
+	    && metrics_signature() != LOAD(exported_signature)) {
+		STORE(export_wanted, true);
+		wake(wake_fd);
+	}
+}
+
+static void
+display_reloaded(Display *display)
+{
+	display->reloading = false;
+	reload_done(display->reload_generation, 0, 1);
+}
+
+static void
+display_started(Display *display)
+{
+	display->starting = false;
+	if (__atomic_sub_fetch(&starting, 1, __ATOMIC_RELAXED) == 0 && notify != NULL) {
+		notify_send(notify, "READY=1");
+	}
+}
+
+/* Verify between 3/4 and 5/4 of the interval from now, so that displays
+ * started or reconnected together, or served by separate processes, drift
+ * apart instead of checking with their servers at once. The check is lazy:
+ * it rides along with other wakeups of the worker in its last eighth. */
+static void
+display_schedule_verify(Display *display)
+{
+	uint64_t interval = display->config->verify * NSEC_PER_SEC, earliest;
+
+	earliest = metrics_now() + interval / 4 * 3 + interval / 2 / 1024 * (rand_r(&display->seed) % 1024);
+	timer_add_lazy(display->worker->timers, &display->verify, earliest, earliest + interval / 8);
+}
+
+static bool
+worker_start(Worker *worker)
+{
+	if ((worker->timers = timers_new()) == NULL) {
+		return false;
+	}
+	if ((worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1
+	    || (worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		fprintf(stderr, "Cannot set up worker: %s\n", strerror(errno));
+		return false;
+	}
+	if (!watch(worker->epoll_fd, worker->wake_fd, worker)
+	    || !watch(worker->epoll_fd, timers_fd(worker->timers), worker->timers)) {
+		return false;
+	}
+	worker->load_at = metrics_now();
+	worker->config = config;
+	worker->generation = config_generation;
+	if ((errno = pthread_create(&worker->thread, NULL, worker_run, worker)) != 0) {
+		fprintf(stderr, "Cannot start worker: %s\n", strerror(errno));
+		return false;
+	}
 	return true;
 }
 
+static void *
+worker_run(void *data)
+{
+	Worker *worker = data;
+	Display *display, *intake, *displays = NULL;
+	struct epoll_event events[64];
+	uint64_t count;
+	int i, n;
+
+	while (!LOAD(worker->stop)) {
+		timers_arm(worker->timers);
+		n = epoll_wait(worker->epoll_fd, events, ARR_LEN(events), -1);
+		if (n == -1 && errno != EINTR) {
+			worker_fail(worker, "Cannot wait for events: %s\n", strerror(errno));
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == worker) {
+				if (read(worker->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+					worker_fail(worker, "Cannot read eventfd: %s\n", strerror(errno));
+				}
+			} else if (events[i].data.ptr != worker->timers) {
+				display = events[i].data.ptr;
+				display_dispatch(display);
+				display_update(display);
+			}
+		}
+
+		intake = __atomic_exchange_n(&worker->intake, NULL, __ATOMIC_ACQUIRE);
+		while ((display = intake) != NULL) {
+			intake = display->next;
+			display->next = displays;
+			displays = display;
+			timer_init(&display->reconnect, on_reconnect, display);
+			timer_init(&display->deadline, on_deadline, display);
+			timer_init(&display->verify, on_verify, display);
+			display->seed = metrics_now() ^ getpid() ^ (uintptr_t) display;
+			if (!arena_init(&display->arena, DISPLAY_ARENA_SIZE)) {
+				worker_fail(worker, "Cannot set up display %s.\n",
+				            (display->name != NULL) ? display->name : "");
+				continue;
+			}
+			display->starting = true;
+			if (display_connect(display)) {
+				display_update(display);
+			} else {
+				timer_add(worker->timers, &display->reconnect,
+				          metrics_now() + display->backoff * NSEC_PER_SEC);
+			}
+		}
+
+		if (LOAD(config_generation) != worker->generation) {
+			worker_reload(worker, displays);
+		}
+		timers_run(worker->timers);
+		STORE(worker->watchdog, LOAD(watchdog_round));
+	}
+
+	for (display = displays; display != NULL; display = display->next) {
+		if (display->connection != NULL) {
+			display_disconnect(display);
+		}
+		if (display->trace != NULL) {
+			trace_close(display->trace);
+		}
+		arena_destroy(&display->arena);
+	}
+	return NULL;
+}
+
+/* Called by the main thread only, so that the intake has a single producer
+ * and the worker taking all of it at once is safe from ABA. */
+static void
+worker_add(Worker *worker, Display *display)
+{
+	display->worker = worker;
+	display->config = &worker->config;
+	display->next = __atomic_load_n(&worker->intake, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&worker->intake, &display->next, display,
+	                                    true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	worker->assigned++;
+	wake(worker->wake_fd);
+}
+
+static void
+worker_account(Worker *worker, uint64_t events)
+{
+	uint64_t now = metrics_now(), load = worker_load(worker, now);
+
+	/* Keep the fraction of a second that has not been decayed yet. */
+	STORE(worker->load_at, now - (now - LOAD(worker->load_at)) % NSEC_PER_SEC);
+	STORE(worker->load, load + events);
+}
+
+/* The events handled recently, halved for every second since. Read without
+ * synchronization by the main thread, which only needs an estimate. */
+static uint64_t
+worker_load(const Worker *worker, uint64_t now)
+{
+	uint64_t at = LOAD(worker->load_at), seconds = (now > at) ? (now - at) / NSEC_PER_SEC : 0;
+
+	return (seconds < 64) ? LOAD(worker->load) >> seconds : 0;
+}
+
+/* The worker with the fewest recent events, of those the one with the fewest
+ * displays. */
+static Worker *
+least_loaded(Worker *workers, size_t nworkers)
+{
+	uint64_t now = metrics_now(), load, min = UINT64_MAX;
+	Worker *least = NULL;
+	size_t i;
+
+	for (i = 0; i < nworkers; i++) {
+		load = worker_load(&workers[i], now);
+		if (least == NULL || load < min || (load == min && workers[i].assigned < least->assigned)) {
+			least = &workers[i];
+			min = load;
+		}
+	}
+	return least;
+}
+
+/* Take over the settings published by the main thread and reapply them to
+ * all displays of the worker in one burst: the requests for every display are
+ * sent before waiting for any reply, which are collected as they come in like
+ * those of hotplugs. Changing the settings of a fleet of displays takes about
+ * one round-trip, not one per display. Displays not connected pick the new
+ * settings up when they reconnect. */
+static void
+worker_reload(Worker *worker, Display *displays)
+{
+	Display *display;
+	uint16_t verify = worker->config.verify;
+	unsigned int n = 0;
+
+	pthread_mutex_lock(&config_lock);
+	worker->config = config;
+	worker->generation = config_generation;
+	pthread_mutex_unlock(&config_lock);
+
+	metrics_op_begin(METRICS_OP_RELOAD);
+	for (display = displays; display != NULL; display = display->next) {
+		if (display->connection == NULL) {
+			continue;
+		}
+		wxkbd_set_repeat(display->wxkbd, worker->config.rate, worker->config.delay);
+		wxkbd_set_debounce(display->wxkbd, worker->config.debounce);
+		wxkbd_set_verify_on_change(display->wxkbd, worker->config.verify > 0);
+		if (wxkbd_apply(display->wxkbd)) {
+			display->reloading = true;
+			display->reload_generation = worker->generation;
+			n++;
+		}
+	}
+	metrics_op_end();
+
+	/* Count the displays when giving up the token of this worker. */
+	reload_done(worker->generation, n, 1);
+	for (display = displays; display != NULL; display = display->next) {
+		if (display->connection == NULL) {
+			continue;
+		}
+		/* A check due with the old interval is rescheduled, or dropped. */
+		if (worker->config.verify != verify) {
+			timer_cancel(worker->timers, &display->verify);
+		}
+		display_update(display);
+	}
+}
+
+/* err() for workers: exiting is left to the main thread, which stops all
+ * workers first. This one stops at the end of its round. */
+static void
+worker_fail(Worker *worker, char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	STORE(worker->stop, true);
+	STORE(failed, true);
+	wake(wake_fd);
+}
+
+/* Account displays that started and finished reapplying generation, ignored
+ * once a newer one was published. */
+static void
+reload_done(unsigned int generation, unsigned int started, unsigned int done)
+{
+	pthread_mutex_lock(&config_lock);
+	if (generation == config_generation) {
+		reloading += started;
+		reloading -= done;
+		if (reloading == 0) {
+			fprintf(stderr, "Applied new settings to all displays in %.3f ms.\n",
+			        (metrics_now() - reload_start) / 1e6);
+		}
+	}
+	pthread_mutex_unlock(&config_lock);
+}
+
+/* Read lines of the form "key value" for the keys rate, delay, debounce and
+ * verify, leaving settings not mentioned as they are. Empty lines and lines
+ * starting with # are skipped. */
 static bool
-set_repeat_rate_and_delay(xcb_connection_t *connection, uint16_t rate, uint16_t delay)
+read_config(const char *path, Config *config)
 {
-	uint16_t repeat_interval;
-	const uint8_t per_key_repeat[ARR_LEN(((xcb_xkb_set_controls_request_t *)0)->perKeyRepeat)] = {0};
-	xcb_generic_error_t *error;
-	xcb_void_cookie_t cookie;
+	char line[256], key[32], value[32];
+	unsigned int lineno = 0;
+	uint16_t *setting;
+	Config new = *config;
+	FILE *f;
 
-	if (rate > 1000 || rate < 1) {
+	if ((f = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "Cannot read %s: %s\n", path, strerror(errno));
 		return false;
 	}
-	repeat_interval = 1000 / rate;
-
-	/* This just bluntly reapplies the rate and delay settings to the (emulated)
-	 * core keyboard. In the future one may set the configuration on the devices
-	 * individually using the deviceid from the XCB_INPUT_HIERARCHY event.
-	 *
-	 * Also, are you f*** kidding xcb?! Why can't I just pass a struct instead
-	 * of having to specify each request argument individually. Xlib handles
-	 * this way better: not only does XkbSetControls() allow to pass a struct,
-	 * there is also a XkbSetAutoRepeatRate() function which makes this process
-	 * even simpler.
-	 */
-	cookie = xcb_xkb_set_controls_checked(connection, XCB_XKB_ID_USE_CORE_KBD,
-	                                      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	                                      XCB_XKB_BOOL_CTRL_REPEAT_KEYS,
-	                                      delay, repeat_interval,
-	                                      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, per_key_repeat);
-	error = xcb_request_check(connection, cookie);
-	if (error) {
-		fprintf(stderr, "Cannot set keyboard repeat rate and delay: %d\n", error->error_code);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		if (sscanf(line, " %31s", key) != 1 || key[0] == '#') {
+			continue;
+		}
+		if (strcmp(key, "rate") == 0) {
+			setting = &new.rate;
+		} else if (strcmp(key, "delay") == 0) {
+			setting = &new.delay;
+		} else if (strcmp(key, "debounce") == 0) {
+			setting = &new.debounce;
+		} else if (strcmp(key, "verify") == 0) {
+			setting = &new.verify;
+		} else {
+			setting = NULL;
+		}
+		if (setting == NULL || sscanf(line, " %31s %31s", key, value) != 2
+		    || !str_to_uint16(value, setting)) {
+			fprintf(stderr, "%s:%u: Invalid setting.\n", path, lineno);
+			fclose(f);
+			return false;
+		}
+	}
+	fclose(f);
+
+	if (new.rate > 1000 || new.rate < 1 || new.delay < 1) {
+		fprintf(stderr, "%s: Key repeat rate has to be between 1 and 1000, delay greater than 0.\n", path);
 		return false;
 	}
+	*config = new;
+	return true;
+}
+
+/* On SIGHUP: read the settings again and have all workers reapply them. The
+ * options given on the command line, in base, stand in for settings missing
+ * from the file. */
+static void
+publish_config(const Config *base, Worker *workers, size_t nworkers)
+{
+	Config new = *base;
+	size_t i;
+
+	if (config_path != NULL && !read_config(config_path, &new)) {
+		fprintf(stderr, "Keeping the current settings.\n");
+		return;
+	}
+
+	pthread_mutex_lock(&config_lock);
+	config = new;
+	config_generation++;
+	reload_start = metrics_now();
+	reloading = nworkers;
+	pthread_mutex_unlock(&config_lock);
+
+	for (i = 0; i < nworkers; i++) {
+		wake(workers[i].wake_fd);
+	}
+}
+
+/* Lost connections, and those that failed on startup, are retried with
+ * exponential backoff. */
+static void
+on_reconnect(Timer *timer, void *data)
+{
+	Display *display = data;
+	bool connected;
+
+	PROBE1(reconnect, display->backoff);
+	metrics_op_begin(METRICS_OP_RECONNECT);
+	connected = display_connect(display);
+	metrics_op_end();
+	if (connected) {
+		metrics_count(METRICS_RECONNECTS);
+		display->backoff = RECONNECT_MIN;
+		display_update(display);
+	} else {
+		display->backoff = MIN(display->backoff * 2, RECONNECT_MAX);
+		timer_add(display->worker->timers, timer, metrics_now() + display->backoff * NSEC_PER_SEC);
+	}
+}
+
+/* Collecting the replies may read events, which are dispatched right away. */
+static void
+on_deadline(Timer *timer, void *data)
+{
+	Display *display = data;
+
+	(void) timer;
+	display_dispatch(display);
+	display_update(display);
+}
+
+/* The replies are handled by display_dispatch(), which reschedules this. */
+static void
+on_verify(Timer *timer, void *data)
+{
+	Display *display = data;
+
+	(void) timer;
+	wxkbd_verify(display->wxkbd);
+	display_update(display);
+}
 
+/* Scheduled by the main thread once a worker noticed that the metrics
+ * changed. */
+static void
+on_export(Timer *timer, void *data)
+{
+	(void) timer;
+	(void) data;
+	STORE(export_wanted, false);
+	STORE(exported_signature, metrics_signature());
+	exported_at = metrics_now();
+	export_write(export_path);
+}
+
+/* Ping the service manager if all event loops run: the main one runs this,
+ * and every worker went through its loop since the last round. The workers
+ * are woken up for the next one. */
+static void
+on_watchdog(Timer *timer, void *data)
+{
+	Watchdog *watchdog = data;
+	unsigned int round = LOAD(watchdog_round);
+	uint64_t now = metrics_now();
+	size_t i;
+
+	for (i = 0; i < watchdog->nworkers && LOAD(watchdog->workers[i].watchdog) == round; i++)
+		;
+	if (i == watchdog->nworkers) {
+		notify_send(notify, "WATCHDOG=1");
+	}
+	STORE(watchdog_round, round + 1);
+	for (i = 0; i < watchdog->nworkers; i++) {
+		wake(watchdog->workers[i].wake_fd);
+	}
+	timer_add_lazy(timers, timer, now + watchdog->interval / 4, now + watchdog->interval / 2);
+}
+
+static void
+wake(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+		fprintf(stderr, "Cannot write eventfd: %s\n", strerror(errno));
+	}
+}
+
+static bool
+watch(int epoll_fd, int fd, void *ptr)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = ptr };
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		fprintf(stderr, "Cannot watch file descriptor: %s\n", strerror(errno));
+		return false;
+	}
 	return true;
 }
 
+static void
+on_signal(int sig)
+{
+	int saved_errno = errno;
+	uint64_t one = 1;
+
+	switch (sig) {
+	case SIGUSR1:
+		dump_recorder = 1;
+		break;
+	case SIGUSR2:
+		dump_metrics = 1;
+		break;
+	case SIGHUP:
+		reload = 1;
+		break;
+	case SIGINT:
+	case SIGTERM:
+		running = 0;
+		break;
+	}
+	if (write(wake_fd, &one, sizeof(one)) == -1) {
+		/* Already pending */
+	}
+	errno = saved_errno;
+}
+
+static void
+write_recorder(const char *path)
+{
+	FILE *f;
+
+	if (path == NULL) {
+		recorder_dump(stderr);
+		return;
+	}
+	if ((f = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "Cannot write flight recorder to %s: %s\n", path, strerror(errno));
+		return;
+	}
+	recorder_dump(f);
+	fclose(f);
+}
+
+static void
+publish_device(const WxkbdDevice *device, void *data)
+{
+	static const char *types[] = {
+		[XCB_INPUT_DEVICE_TYPE_MASTER_POINTER] = "master-pointer",
+		[XCB_INPUT_DEVICE_TYPE_MASTER_KEYBOARD] = "master-keyboard",
+		[XCB_INPUT_DEVICE_TYPE_SLAVE_POINTER] = "slave-pointer",
+		[XCB_INPUT_DEVICE_TYPE_SLAVE_KEYBOARD] = "slave-keyboard",
+		[XCB_INPUT_DEVICE_TYPE_FLOATING_SLAVE] = "floating-slave",
+	};
+	/* In the order of the XCB_INPUT_HIERARCHY_MASK_* bits */
+	static const char *changes[] = {
+		"master-added", "master-removed", "slave-added", "slave-removed",
+		"slave-attached", "slave-detached", "device-enabled", "device-disabled",
+	};
+	Display *display = data;
+	char line[512];
+	const char *sep = "";
+	size_t i;
+	int len;
+
+	len = snprintf(line, sizeof(line),
+	               "{\"display\":\"%.64s\",\"time\":%u,\"device\":%u,\"attachment\":%u,\"type\":\"%s\",\"enabled\":%s,\"changes\":[",
+	               (display->name != NULL) ? display->name : "", device->time, device->deviceid, device->attachment,
+	               (device->type < ARR_LEN(types) && types[device->type]) ? types[device->type] : "unknown",
+	               device->enabled ? "true" : "false");
+	for (i = 0; i < ARR_LEN(changes); i++) {
+		if (device->flags & (1 << i)) {
+			len += snprintf(line + len, sizeof(line) - len, "%s\"%s\"", sep, changes[i]);
+			sep = ",";
+		}
+	}
+	len += snprintf(line + len, sizeof(line) - len, "]}\n");
+
+	bus_publish(bus, line, len);
+}
+
 static bool
 str_to_uint16(const char *str, uint16_t *res)
 {
@@ -123,10 +869,44 @@ err(char *fmt, ...)
 	exit(EXIT_FAILURE);
 }
 
+/* Apply the settings to every display and return, without selecting events or
+ * starting workers. The displays are done one after the other: each takes two
+ * round-trips after connecting, see wxkbd_apply_once(). */
+static int
+apply_once(const char **names, size_t ndisplays)
+{
+	xcb_connection_t *connection;
+	uint64_t start;
+	size_t i;
+	int status = EXIT_SUCCESS;
+
+	for (i = 0; i < ndisplays; i++) {
+		start = metrics_now();
+		connection = xcb_connect(names[i], NULL);
+		metrics_request();
+		metrics_roundtrip(metrics_now() - start);
+		if (xcb_connection_has_error(connection)) {
+			fprintf(stderr, "Cannot connect to server %s.\n", (names[i] != NULL) ? names[i] : "");
+			status = EXIT_FAILURE;
+		} else {
+			metrics_startup(METRICS_STARTUP_CONNECTED);
+			if (!wxkbd_apply_once(connection, config.rate, config.delay)) {
+				status = EXIT_FAILURE;
+			}
+		}
+		xcb_disconnect(connection);
+	}
+	if (export_path != NULL) {
+		export_write(export_path);
+	}
+
+	return status;
+}
+
 static void
 usage(char *progname, int exit_code)
 {
-	printf("Usage: %s [-V] [-r rate] [-d delay]\n", (progname == NULL) ? NAME : progname);
+	printf("Usage: %s [-V] [-o] [-r rate] [-d delay] [-s socket] [-m file] [-i interval] [-f file] [-b requests] [-t trace] [-w debounce] [-v interval] [-j threads] [-c file] [-D display]...\n", (progname == NULL) ? NAME : progname);
 	exit(exit_code);
 }
 
@@ -140,20 +920,31 @@ version(void)
 int
 main(int argc, char *argv[])
 {
-	int opt;
-	uint16_t rate = default_rate, delay = default_delay;
-	xcb_connection_t *connection;
-	xcb_screen_t *screen;
-	xcb_window_t root;
-	const xcb_query_extension_reply_t *xinput_query;
-	const xcb_query_extension_reply_t *xkb_query;
-	InputEventMask input_mask;
-	xcb_xkb_use_extension_cookie_t use_extension_cookie;
-	xcb_xkb_use_extension_reply_t *use_extension_reply;
-	xcb_generic_error_t *error;
-	xcb_generic_event_t *event;
+	int opt, i, n;
+	bool once = false;
+	uint16_t threads = 1;
+	size_t ndisplays = 0, nworkers, j;
+	Display *displays;
+	Worker *workers;
+	Timer export;
+	Watchdog watchdog;
+	Config base;
+	const char *bus_path = NULL, *recorder_path = NULL;
+	const char **names;
+	uint64_t count;
+	struct epoll_event events[4];
+	struct sigaction sa;
+	sigset_t signals;
+
+	metrics_startup(METRICS_STARTUP_MAIN);
+	config.rate = default_rate;
+	config.delay = default_delay;
+	export_interval = default_export_interval;
+	if ((names = calloc(argc, sizeof(*names))) == NULL) {
+		err("Cannot allocate memory.\n");
+	}
 
-	while ((opt = getopt(argc, argv, "hVr:d:")) != -1) {
+	while ((opt = getopt(argc, argv, "hVor:d:s:m:i:f:b:t:w:v:D:j:c:")) != -1) {
 		switch(opt) {
 		case 'h':
 			usage(argv[0], EXIT_SUCCESS);
@@ -161,132 +952,222 @@ main(int argc, char *argv[])
 		case 'V':
 			version();
 			break;
+		case 'o':
+			once = true;
+			break;
 		case 'r':
-			if (!str_to_uint16(optarg, &rate)) {
+			if (!str_to_uint16(optarg, &config.rate)) {
 				usage(argv[0], EXIT_FAILURE);
 			}
-			if (rate > 1000 || rate < 1) {
+			if (config.rate > 1000 || config.rate < 1) {
 				err("Key repeat rate has to be between 1 and 1000.\n");
 			}
 			break;
 		case 'd':
-			if (!str_to_uint16(optarg, &delay)) {
+			if (!str_to_uint16(optarg, &config.delay)) {
 				usage(argv[0], EXIT_FAILURE);
 			}
-			if (delay < 1) {
+			if (config.delay < 1) {
 				err("Key repeat delay has to be greater than 0.\n");
 			}
 			break;
+		case 's':
+			bus_path = optarg;
+			break;
+		case 'm':
+			export_path = optarg;
+			break;
+		case 'i':
+			if (!str_to_uint16(optarg, &export_interval)) {
+				usage(argv[0], EXIT_FAILURE);
+			}
+			if (export_interval < 1) {
+				err("Metrics interval has to be greater than 0.\n");
+			}
+			break;
+		case 'f':
+			recorder_path = optarg;
+			break;
+		case 'b':
+			if (!str_to_uint16(optarg, &budget) || budget < 1) {
+				usage(argv[0], EXIT_FAILURE);
+			}
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 'w':
+			if (!str_to_uint16(optarg, &config.debounce)) {
+				usage(argv[0], EXIT_FAILURE);
+			}
+			break;
+		case 'v':
+			if (!str_to_uint16(optarg, &config.verify)) {
+				usage(argv[0], EXIT_FAILURE);
+			}
+			break;
+		case 'j':
+			if (!str_to_uint16(optarg, &threads) || threads < 1) {
+				usage(argv[0], EXIT_FAILURE);
+			}
+			break;
+		case 'D':
+			names[ndisplays++] = optarg;
+			break;
+		case 'c':
+			config_path = optarg;
+			break;
 		}
 	}
 
-	connection = xcb_connect(NULL, NULL);
-	if (xcb_connection_has_error(connection)) {
-		err("Cannot connect to server.\n");
-	}
-
-	xinput_query = xcb_get_extension_data(connection, &xcb_input_id);
-	if (!xinput_query->present) {
-		err("Server does not support XInput.\n");
-	}
-	xkb_query = xcb_get_extension_data(connection, &xcb_xkb_id);
-	if (!xkb_query->present) {
-		err("Server does not support XKB.\n");
-	}
-
-	screen = xcb_setup_roots_iterator(xcb_get_setup(connection)).data;
-	if (screen == NULL) {
-		err("Cannot acquire screen.\n");
-	}
-
-	root = screen->root;
-
-	/* This took me a bit of figuring out:
-	 * xcb_input_xi_select_events() takes an argument of type struct
-	 * xcb_input_event_mask_t, but looking at the header, the type has no space
-	 * for the actual mask:
-	 *
-	 *      typedef struct xcb_input_event_mask_t {
-	 *          xcb_input_device_id_t deviceid;
-	 *          uint16_t              mask_len;
-	 *      } xcb_input_event_mask_t;
-	 *
-	 *  In comparison, the corresponging XIEventMask in Xlib has a mask field.
-	 *  The XCB XML protocol description *does* indicate a mask field of type list
-	 *  (array in C terms):
-	 *
-	 *     <struct name="EventMask">
-	 *         <field type="DeviceId" name="deviceid" altenum="Device" />
-	 *         <field type="CARD16" name="mask_len" />
-	 *         <list type="CARD32" name="mask" mask="XIEventMask">
-	 *             <fieldref>mask_len</fieldref>
-	 *         </list>
-	 *     </struct>
-	 *
-	 * The EventMask struct does indeed have a mask field, which is an array of
-	 * unit32_t's with a length of mask_len, though it seems we are on our own
-	 * with xcb when it comes to constructing such a data structure. Doing a
-	 * code search, there aren't that many examples. What they do is construct a
-	 * new struct with both the xcb_input_event_mask_t as a field and the actual
-	 * masks (usual just one value instead of a whole array) after that:
-	 *
-	 *     struct {
-	 *         xcb_input_event_mask_t head;
-	 *         xcb_input_xi_event_mask_t mask;
-	 *     } mask;
-	 *
-	 *     mask m;
-	 *     m.head.deviceid = XCB_INPUT_DEVICE_ALL;
-	 *     m.head.mask_len = 1 // sizeof(m.mask) / sizeof(unit32_t) in case of multiple masks
-	 *     m.mask = XCB_INPUT_EVENT_MASK_MOTION;
-	 *
-	 *     xcb_input_xi_select_events(conn, scr->root, 1, &m.head);
-	 *
-	 * When we receive such a list from the server, xcb generates iterator
-	 * methods like xcb_input_xi_event_masks_iterator() and
-	 * xcb_input_xi_event_mask_next(), but when we have to construct such data,
-	 * we are on our own apparently.
-	 */
-
-	input_mask.info.deviceid = XCB_INPUT_DEVICE_ALL;
-	input_mask.info.mask_len = 1;
-	input_mask.mask = XCB_INPUT_XI_EVENT_MASK_HIERARCHY;
-	xcb_input_xi_select_events(connection, root, 1, &input_mask.info);
-	xcb_flush(connection);
-
-	/* This took a while to figure out: before using the XKB extension, a call
-	 * to xcb_xkb_use_extension() is required, otherwise normal XKB requests
-	 * will return an Access Error. */
-	use_extension_cookie = xcb_xkb_use_extension(connection, XCB_XKB_MAJOR_VERSION, XCB_XKB_MINOR_VERSION);
-	use_extension_reply = xcb_xkb_use_extension_reply(connection, use_extension_cookie, &error);
-	if (error) {
-		err("Cannot use XKB: %d\n", error->error_code);
-	}
-	free(use_extension_reply);
-
-	/* Set repeat rate and delay once on startup. */
-	set_repeat_rate_and_delay(connection, rate, delay);
-
-	while ((event = xcb_wait_for_event(connection)) != NULL) {
-		if (is_hierarchy_event(event, xinput_query)) {
-			xcb_input_hierarchy_event_t *e = (xcb_input_hierarchy_event_t *) event;
-
-			set_repeat_rate_and_delay(connection, rate, delay);
-
-			/* In case one wants to set configuration on individual keyboards
-			 * at some point, one can use an iterator like this:
-			 *
-			 *     xcb_input_hierarchy_info_iterator_t info = xcb_input_hierarchy_infos_iterator(e);
-			 *     for (; info.rem > 0; xcb_input_hierarchy_info_next(&info)) {
-			 *         // info.data
-			 *     }
-			 */
+	/* The settings from the file win over the command line, also when
+	 * they are read again. */
+	base = config;
+	if (config_path != NULL && !read_config(config_path, &config)) {
+		exit(EXIT_FAILURE);
+	}
+
+	/* Without -D, the display in $DISPLAY */
+	if (ndisplays == 0) {
+		ndisplays = 1;
+	}
+	if (once) {
+		return apply_once(names, ndisplays);
+	}
+	nworkers = MIN(threads, ndisplays);
+	if ((displays = calloc(ndisplays, sizeof(*displays))) == NULL
+	    || (workers = calloc(nworkers, sizeof(*workers))) == NULL) {
+		err("Cannot allocate memory.\n");
+	}
+
+	if ((timers = timers_new()) == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1
+	    || (wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		err("Cannot create epoll instance: %s\n", strerror(errno));
+	}
+	if (!watch(epoll_fd, timers_fd(timers), timers) || !watch(epoll_fd, wake_fd, &wake_fd)) {
+		exit(EXIT_FAILURE);
+	}
+
+	/* The handler wakes the loop through wake_fd: a signal arriving after the
+	 * flags were checked, but before epoll_wait(), would otherwise wait for
+	 * the next event, which may never come. The signals are blocked in the
+	 * workers, which inherit the mask. */
+	sa.sa_handler = on_signal;
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGUSR2);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGHUP);
+
+	if (bus_path != NULL && (bus = bus_new(bus_path)) == NULL) {
+		exit(EXIT_FAILURE);
+	}
+	if (bus != NULL && !watch(epoll_fd, bus_fd(bus), bus)) {
+		exit(EXIT_FAILURE);
+	}
+	notify = notify_new();
+	starting = ndisplays;
+
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	for (j = 0; j < nworkers; j++) {
+		if (!worker_start(&workers[j])) {
+			exit(EXIT_FAILURE);
 		}
+	}
+	pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+	for (j = 0; j < ndisplays; j++) {
+		displays[j].name = names[j];
+		displays[j].config = &config;
+		displays[j].backoff = RECONNECT_MIN;
+		worker_add(least_loaded(workers, nworkers), &displays[j]);
+	}
 
-		free(event);
+	if (export_path != NULL) {
+		timer_init(&export, on_export, NULL);
+		timer_add(timers, &export, metrics_now());
+	}
+	if (notify != NULL && notify_watchdog(notify) > 0) {
+		watchdog.workers = workers;
+		watchdog.nworkers = nworkers;
+		watchdog.interval = notify_watchdog(notify);
+		timer_init(&watchdog.timer, on_watchdog, &watchdog);
+		timer_add(timers, &watchdog.timer, metrics_now());
 	}
 
-	xcb_flush(connection);
-	xcb_disconnect(connection);
-	return EXIT_SUCCESS;
+	/* Everything timed is done by timers, the loops only sleep for as long
+	 * as there is nothing due, indefinitely if nothing is scheduled. An
+	 * idle daemon has nothing scheduled: the deadline timers are only set
+	 * while applies are outstanding, and the export only once a worker
+	 * noticed that the metrics changed, lazily, so that it is written on a
+	 * wakeup for something else if there is one within the interval. Only
+	 * the watchdog, if the service manager enabled it, wakes it up
+	 * regularly. */
+	while (running && !LOAD(failed)) {
+		timers_arm(timers);
+		n = epoll_wait(epoll_fd, events, ARR_LEN(events), -1);
+		if (n == -1 && errno != EINTR) {
+			err("Cannot wait for events: %s\n", strerror(errno));
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == bus) {
+				bus_accept(bus);
+			} else if (events[i].data.ptr == &wake_fd
+			           && read(wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+				err("Cannot read eventfd: %s\n", strerror(errno));
+			}
+		}
+		if (export_path != NULL && LOAD(export_wanted) && !timer_pending(&export)) {
+			timer_add_lazy(timers, &export, exported_at + export_interval * NSEC_PER_SEC,
+			               exported_at + 2 * export_interval * NSEC_PER_SEC);
+		}
+		timers_run(timers);
+		if (reload) {
+			reload = 0;
+			publish_config(&base, workers, nworkers);
+		}
+		if (dump_metrics) {
+			dump_metrics = 0;
+			metrics_dump(stderr);
+		}
+		if (dump_recorder) {
+			dump_recorder = 0;
+			write_recorder(recorder_path);
+		}
+	}
+
+	if (notify != NULL) {
+		notify_send(notify, "STOPPING=1");
+	}
+	for (j = 0; j < nworkers; j++) {
+		STORE(workers[j].stop, true);
+		wake(workers[j].wake_fd);
+		pthread_join(workers[j].thread, NULL);
+		close(workers[j].wake_fd);
+		close(workers[j].epoll_fd);
+		timers_free(workers[j].timers);
+	}
+	if (bus != NULL) {
+		bus_free(bus);
+	}
+	if (notify != NULL) {
+		notify_free(notify);
+	}
+	close(wake_fd);
+	close(epoll_fd);
+	timers_free(timers);
+	free(workers);
+	free(displays);
+	free(names);
+	return LOAD(failed) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,125 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* libwxkbd - the hotplug/apply engine of wxkbd for embedding into programs
+ * that already own an xcb connection and an event loop, e.g. window managers.
+ *
+ * Usage:
+ *
+ *     Wxkbd *wxkbd = wxkbd_new(connection, 70, 250);
+ *     ...
+ *     while ((event = xcb_wait_for_event(connection))) {
+ *         if (!wxkbd_handle_event(wxkbd, event)) {
+ *             // the program's own event handling
+ *         }
+ *         free(event);
+ *         wxkbd_handle_replies(wxkbd);
+ *     }
+ *     ...
+ *     wxkbd_free(wxkbd);
+ *
+ * wxkbd_new() selects XInput hierarchy events for XCB_INPUT_DEVICE_ALL on the
+ * root window of the first screen. XISelectEvents replaces the mask a client
+ * has for that window and device, so a program selecting other XInput events
+ * there has to include XCB_INPUT_XI_EVENT_MASK_HIERARCHY in its own mask.
+ *
+ * Settings are applied without waiting for the server: the requests are sent
+ * and their replies collected by wxkbd_handle_replies(), which has to be called
+ * whenever the connection was readable. At most a fixed number of applies is
+ * outstanding at any time; while the server doesn't keep up, further applies
+ * for a keyboard are folded into one, sent once there is room again.
+ * Replies that don't arrive within a deadline are counted as timeouts.
+ * wxkbd_new() waits for the replies it needs, but only up to the same
+ * deadline.
+ *
+ * The connection remains owned by the caller and has to outlive the Wxkbd
+ * handle. None of the functions exit the program; errors are reported on
+ * stderr and signalled through the return value.
+ */
+
+#ifndef WXKBD_H
+#define WXKBD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <xcb/xcb.h>
+
+typedef struct Wxkbd Wxkbd;
+
+/* A device entry of a hierarchy event, passed to the WxkbdDeviceFunc for
+ * every device the event reports a change for. */
+typedef struct WxkbdDevice {
+	uint16_t deviceid;
+	uint16_t attachment;
+	uint8_t type;           /* XCB_INPUT_DEVICE_TYPE_* */
+	bool enabled;
+	uint32_t flags;         /* XCB_INPUT_HIERARCHY_MASK_* */
+	uint32_t time;          /* server time of the hierarchy event */
+} WxkbdDevice;
+
+typedef void (*WxkbdDeviceFunc)(const WxkbdDevice *device, void *data);
+
+/* Set up the XInput and XKB extensions on connection, select hierarchy
+ * events and the XKB events concerning the settings, and start applying rate
+ * and delay. Returns NULL on failure. */
+Wxkbd *wxkbd_new(xcb_connection_t *connection, uint16_t rate, uint16_t delay);
+/* The memory wxkbd_new_in() needs. It is fixed: wxkbd allocates nothing
+ * after setting up. */
+size_t wxkbd_size(void);
+/* Like wxkbd_new(), in the wxkbd_size() bytes at mem, aligned for any type,
+ * which the caller releases after wxkbd_free(). */
+Wxkbd *wxkbd_new_in(void *mem, xcb_connection_t *connection, uint16_t rate, uint16_t delay);
+/* Apply rate and delay to the core keyboard once, without selecting events,
+ * in as few round-trips as possible: one for the extension query, and one for
+ * XkbUseExtension, SetControls and GetControls sent together. Returns whether
+ * the server confirmed the settings. */
+bool wxkbd_apply_once(xcb_connection_t *connection, uint16_t rate, uint16_t delay);
+/* Feed an event received on the connection. Returns true if wxkbd sent or
+ * scheduled requests for the event, a hierarchy event adding a keyboard or an
+ * XKB event, false if it belongs to the caller or needs nothing. The event is
+ * not freed. */
+bool wxkbd_handle_event(Wxkbd *wxkbd, const xcb_generic_event_t *event);
+/* Register func to be called with data for every device added, removed or
+ * changed, before wxkbd reacts to the event. Pass NULL to unregister. */
+void wxkbd_set_device_func(Wxkbd *wxkbd, WxkbdDeviceFunc func, void *data);
+/* Hold back applies for hierarchy events until none came for msec
+ * milliseconds, folding all events of a keyboard until then into one apply.
+ * 0, the default, applies right away. */
+void wxkbd_set_debounce(Wxkbd *wxkbd, unsigned int msec);
+/* Check the settings with wxkbd_verify() whenever the server reports that the
+ * repeat controls changed, rather than only when asked to. Off by default. */
+void wxkbd_set_verify_on_change(Wxkbd *wxkbd, bool enable);
+/* Change the settings of later applies. Those sent already are not redone,
+ * use wxkbd_apply() for that. */
+void wxkbd_set_repeat(Wxkbd *wxkbd, uint16_t rate, uint16_t delay);
+/* Collect the replies to applies received on the connection so far, without
+ * blocking, and send the applies that waited for them or are due. */
+void wxkbd_handle_replies(Wxkbd *wxkbd);
+/* The time, in nanoseconds of CLOCK_MONOTONIC, at which
+ * wxkbd_handle_replies() has to be called at the latest, to send debounced
+ * applies or to notice a reply that didn't arrive in time. 0 if there is
+ * nothing to wait for. */
+uint64_t wxkbd_deadline(const Wxkbd *wxkbd);
+/* Number of applies not yet confirmed by the server, including those waiting
+ * to be sent. */
+unsigned int wxkbd_pending(const Wxkbd *wxkbd);
+/* Whether the server confirmed the settings of the last apply that
+ * completed, false until one has. */
+bool wxkbd_applied(const Wxkbd *wxkbd);
+/* Apply rate and delay to the core keyboard right away. Returns false if the
+ * apply cannot be sent. */
+bool wxkbd_apply(Wxkbd *wxkbd);
+/* Check that the server still has the settings: the controls of every
+ * keyboard applied to, for now only the core keyboard, are requested in one
+ * burst, and as the replies come in through wxkbd_handle_replies(), the
+ * keyboards whose settings were changed behind the back of wxkbd are applied
+ * to again. Does nothing while the replies to the last check are
+ * outstanding. */
+void wxkbd_verify(Wxkbd *wxkbd);
+void wxkbd_free(Wxkbd *wxkbd);
+
+#endif /* WXKBD_H */
@@ -0,0 +1,248 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* Encodes the requests declared in xcbmin.h for the MINIMAL build. Every
+ * request is a fixed structure, optionally followed by a list, handed to
+ * xcb_send_request(), which fills in the opcodes and the length. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+
+#include "xcbmin.h"
+
+#ifdef MINIMAL
+
+typedef struct UseExtensionRequest {
+	uint8_t major_opcode;
+	uint8_t minor_opcode;
+	uint16_t length;
+	uint16_t wantedMajor;
+	uint16_t wantedMinor;
+} UseExtensionRequest;
+
+typedef struct SelectEventsRequest {
+	uint8_t major_opcode;
+	uint8_t minor_opcode;
+	uint16_t length;
+	xcb_window_t window;
+	uint16_t num_mask;
+	uint8_t pad0[2];
+} SelectEventsRequest;
+
+typedef struct XkbSelectEventsRequest {
+	uint8_t major_opcode;
+	uint8_t minor_opcode;
+	uint16_t length;
+	xcb_xkb_device_spec_t deviceSpec;
+	uint16_t affectWhich;
+	uint16_t clear;
+	uint16_t selectAll;
+	uint16_t affectMap;
+	uint16_t map;
+} XkbSelectEventsRequest;
+
+typedef struct GetControlsRequest {
+	uint8_t major_opcode;
+	uint8_t minor_opcode;
+	uint16_t length;
+	xcb_xkb_device_spec_t deviceSpec;
+	uint8_t pad0[2];
+} GetControlsRequest;
+
+static unsigned int send_request(xcb_connection_t *c, xcb_extension_t *ext, uint8_t opcode, int flags,
+                                 uint8_t isvoid, void *request, size_t len, const void *list, size_t list_len);
+
+/* Bytes of the details of each event type of XkbSelectEvents, in the order of
+ * the bits. MapNotify has its own fields in the request. */
+static const uint8_t select_details_size[] = { 4, 0, 4, 8, 8, 8, 4, 2, 2, 2, 4, 4 };
+
+xcb_extension_t xcb_input_id = { "XInputExtension", 0 };
+xcb_extension_t xcb_xkb_id = { "XKEYBOARD", 0 };
+
+static unsigned int
+send_request(xcb_connection_t *c, xcb_extension_t *ext, uint8_t opcode, int flags, uint8_t isvoid,
+             void *request, size_t len, const void *list, size_t list_len)
+{
+	static const uint8_t pad[4];
+	xcb_protocol_request_t xcb_request = {
+		.count = (list_len > 0) ? 3 : 1,
+		.ext = ext,
+		.opcode = opcode,
+		.isvoid = isvoid,
+	};
+	struct iovec parts[5];
+
+	/* xcb needs the two before the request for itself. The list is padded
+	 * to a multiple of 4 bytes. */
+	parts[2].iov_base = request;
+	parts[2].iov_len = len;
+	parts[3].iov_base = (void *) list;
+	parts[3].iov_len = list_len;
+	parts[4].iov_base = (void *) pad;
+	parts[4].iov_len = -list_len & 3;
+	return xcb_send_request(c, flags, parts + 2, &xcb_request);
+}
+
+xcb_input_hierarchy_info_iterator_t
+xcb_input_hierarchy_infos_iterator(const xcb_input_hierarchy_event_t *R)
+{
+	xcb_input_hierarchy_info_iterator_t i;
+
+	i.data = (xcb_input_hierarchy_info_t *) (R + 1);
+	i.rem = R->num_infos;
+	i.index = (char *) i.data - (char *) R;
+	return i;
+}
+
+void
+xcb_input_hierarchy_info_next(xcb_input_hierarchy_info_iterator_t *i)
+{
+	i->data++;
+	i->rem--;
+	i->index += sizeof(xcb_input_hierarchy_info_t);
+}
+
+xcb_void_cookie_t
+xcb_input_xi_select_events(xcb_connection_t *c, xcb_window_t window, uint16_t num_mask,
+                           const xcb_input_event_mask_t *masks)
+{
+	SelectEventsRequest request = { .window = window, .num_mask = num_mask };
+	const uint8_t *mask = (const uint8_t *) masks;
+	size_t len = 0;
+	xcb_void_cookie_t cookie;
+	uint16_t i;
+
+	/* Every mask is followed by its words. */
+	for (i = 0; i < num_mask; i++) {
+		len += sizeof(*masks) + ((const xcb_input_event_mask_t *) (mask + len))->mask_len * 4;
+	}
+	cookie.sequence = send_request(c, &xcb_input_id, XCB_INPUT_XI_SELECT_EVENTS, 0, 1,
+	                               &request, sizeof(request), masks, len);
+	return cookie;
+}
+
+xcb_xkb_use_extension_cookie_t
+xcb_xkb_use_extension(xcb_connection_t *c, uint16_t wantedMajor, uint16_t wantedMinor)
+{
+	UseExtensionRequest request = { .wantedMajor = wantedMajor, .wantedMinor = wantedMinor };
+	xcb_xkb_use_extension_cookie_t cookie;
+
+	cookie.sequence = send_request(c, &xcb_xkb_id, XCB_XKB_USE_EXTENSION, XCB_REQUEST_CHECKED, 0,
+	                               &request, sizeof(request), NULL, 0);
+	return cookie;
+}
+
+xcb_xkb_use_extension_reply_t *
+xcb_xkb_use_extension_reply(xcb_connection_t *c, xcb_xkb_use_extension_cookie_t cookie, xcb_generic_error_t **e)
+{
+	return xcb_wait_for_reply(c, cookie.sequence, e);
+}
+
+xcb_void_cookie_t
+xcb_xkb_select_events(xcb_connection_t *c, xcb_xkb_device_spec_t deviceSpec, uint16_t affectWhich,
+                      uint16_t clear, uint16_t selectAll, uint16_t affectMap, uint16_t map,
+                      const void *details)
+{
+	XkbSelectEventsRequest request = {
+		.deviceSpec = deviceSpec,
+		.affectWhich = affectWhich,
+		.clear = clear,
+		.selectAll = selectAll,
+		.affectMap = affectMap,
+		.map = map,
+	};
+	uint16_t which = affectWhich & ~clear & ~selectAll;
+	xcb_void_cookie_t cookie;
+	size_t len = 0, i;
+
+	for (i = 0; i < sizeof(select_details_size); i++) {
+		if (which & (1 << i)) {
+			len += select_details_size[i];
+		}
+	}
+	cookie.sequence = send_request(c, &xcb_xkb_id, XCB_XKB_SELECT_EVENTS, 0, 1,
+	                               &request, sizeof(request), details, len);
+	return cookie;
+}
+
+xcb_xkb_get_controls_cookie_t
+xcb_xkb_get_controls(xcb_connection_t *c, xcb_xkb_device_spec_t deviceSpec)
+{
+	GetControlsRequest request = { .deviceSpec = deviceSpec };
+	xcb_xkb_get_controls_cookie_t cookie;
+
+	cookie.sequence = send_request(c, &xcb_xkb_id, XCB_XKB_GET_CONTROLS, XCB_REQUEST_CHECKED, 0,
+	                               &request, sizeof(request), NULL, 0);
+	return cookie;
+}
+
+xcb_xkb_get_controls_reply_t *
+xcb_xkb_get_controls_reply(xcb_connection_t *c, xcb_xkb_get_controls_cookie_t cookie, xcb_generic_error_t **e)
+{
+	return xcb_wait_for_reply(c, cookie.sequence, e);
+}
+
+xcb_void_cookie_t
+xcb_xkb_set_controls_checked(xcb_connection_t *c, xcb_xkb_device_spec_t deviceSpec,
+                             uint8_t affectInternalRealMods, uint8_t internalRealMods,
+                             uint8_t affectIgnoreLockRealMods, uint8_t ignoreLockRealMods,
+                             uint16_t affectInternalVirtualMods, uint16_t internalVirtualMods,
+                             uint16_t affectIgnoreLockVirtualMods, uint16_t ignoreLockVirtualMods,
+                             uint8_t mouseKeysDfltBtn, uint8_t groupsWrap, uint16_t accessXOptions,
+                             uint32_t affectEnabledControls, uint32_t enabledControls,
+                             uint32_t changeControls, uint16_t repeatDelay, uint16_t repeatInterval,
+                             uint16_t slowKeysDelay, uint16_t debounceDelay,
+                             uint16_t mouseKeysDelay, uint16_t mouseKeysInterval,
+                             uint16_t mouseKeysTimeToMax, uint16_t mouseKeysMaxSpeed,
+                             int16_t mouseKeysCurve, uint16_t accessXTimeout,
+                             uint32_t accessXTimeoutMask, uint32_t accessXTimeoutValues,
+                             uint16_t accessXTimeoutOptionsMask, uint16_t accessXTimeoutOptionsValues,
+                             const uint8_t *perKeyRepeat)
+{
+	xcb_xkb_set_controls_request_t request = {
+		.deviceSpec = deviceSpec,
+		.affectInternalRealMods = affectInternalRealMods,
+		.internalRealMods = internalRealMods,
+		.affectIgnoreLockRealMods = affectIgnoreLockRealMods,
+		.ignoreLockRealMods = ignoreLockRealMods,
+		.affectInternalVirtualMods = affectInternalVirtualMods,
+		.internalVirtualMods = internalVirtualMods,
+		.affectIgnoreLockVirtualMods = affectIgnoreLockVirtualMods,
+		.ignoreLockVirtualMods = ignoreLockVirtualMods,
+		.mouseKeysDfltBtn = mouseKeysDfltBtn,
+		.groupsWrap = groupsWrap,
+		.accessXOptions = accessXOptions,
+		.affectEnabledControls = affectEnabledControls,
+		.enabledControls = enabledControls,
+		.changeControls = changeControls,
+		.repeatDelay = repeatDelay,
+		.repeatInterval = repeatInterval,
+		.slowKeysDelay = slowKeysDelay,
+		.debounceDelay = debounceDelay,
+		.mouseKeysDelay = mouseKeysDelay,
+		.mouseKeysInterval = mouseKeysInterval,
+		.mouseKeysTimeToMax = mouseKeysTimeToMax,
+		.mouseKeysMaxSpeed = mouseKeysMaxSpeed,
+		.mouseKeysCurve = mouseKeysCurve,
+		.accessXTimeout = accessXTimeout,
+		.accessXTimeoutMask = accessXTimeoutMask,
+		.accessXTimeoutValues = accessXTimeoutValues,
+		.accessXTimeoutOptionsMask = accessXTimeoutOptionsMask,
+		.accessXTimeoutOptionsValues = accessXTimeoutOptionsValues,
+	};
+	xcb_void_cookie_t cookie;
+
+	memcpy(request.perKeyRepeat, perKeyRepeat, sizeof(request.perKeyRepeat));
+	cookie.sequence = send_request(c, &xcb_xkb_id, XCB_XKB_SET_CONTROLS, XCB_REQUEST_CHECKED, 1,
+	                               &request, sizeof(request), NULL, 0);
+	return cookie;
+}
+
+#endif /* MINIMAL */
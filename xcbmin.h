@@ -0,0 +1,316 @@
+/* See LICENSE file for license details.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+/* The parts of xcb-util, xcb-xinput and xcb-xkb used by wxkbd.
+ *
+ * Built with MINIMAL defined, the few requests wxkbd sends are encoded by
+ * xcbmin.c on top of core libxcb, and the structures and constants it needs
+ * are declared here with the names and wire layout of their xcb counterparts,
+ * so that only libxcb is linked. Otherwise, this includes the xcb headers.
+ *
+ * The names of the functions and extension ids are macros for symbols of
+ * xcbmin's own, so that a program linking libwxkbd.a along with xcb-xinput or
+ * xcb-xkb gets theirs rather than a clash.
+ */
+
+#ifndef XCBMIN_H
+#define XCBMIN_H
+
+#include <xcb/xcb.h>
+
+#ifndef MINIMAL
+
+#include <xcb/xcb_event.h>
+#include <xcb/xinput.h>
+#include <xcb/xkb.h>
+
+#else
+
+#include <stdint.h>
+
+#define xcb_input_id xcbmin_input_id
+#define xcb_input_hierarchy_infos_iterator xcbmin_input_hierarchy_infos_iterator
+#define xcb_input_hierarchy_info_next xcbmin_input_hierarchy_info_next
+#define xcb_input_xi_select_events xcbmin_input_xi_select_events
+#define xcb_xkb_id xcbmin_xkb_id
+#define xcb_xkb_use_extension xcbmin_xkb_use_extension
+#define xcb_xkb_use_extension_reply xcbmin_xkb_use_extension_reply
+#define xcb_xkb_select_events xcbmin_xkb_select_events
+#define xcb_xkb_get_controls xcbmin_xkb_get_controls
+#define xcb_xkb_get_controls_reply xcbmin_xkb_get_controls_reply
+#define xcb_xkb_set_controls_checked xcbmin_xkb_set_controls_checked
+
+#define XCB_EVENT_RESPONSE_TYPE_MASK (0x7f)
+#define XCB_EVENT_RESPONSE_TYPE(e)   (e->response_type & XCB_EVENT_RESPONSE_TYPE_MASK)
+
+/* XInput 2 */
+
+#define XCB_INPUT_XI_CHANGE_HIERARCHY 43
+#define XCB_INPUT_XI_SELECT_EVENTS 46
+#define XCB_INPUT_XI_QUERY_VERSION 47
+
+#define XCB_INPUT_DEVICE_CHANGED 1
+#define XCB_INPUT_HIERARCHY 11
+
+typedef uint16_t xcb_input_device_id_t;
+
+typedef enum xcb_input_device_t {
+	XCB_INPUT_DEVICE_ALL = 0,
+	XCB_INPUT_DEVICE_ALL_MASTER = 1
+} xcb_input_device_t;
+
+typedef enum xcb_input_xi_event_mask_t {
+	XCB_INPUT_XI_EVENT_MASK_HIERARCHY = 1 << 11
+} xcb_input_xi_event_mask_t;
+
+typedef enum xcb_input_device_type_t {
+	XCB_INPUT_DEVICE_TYPE_MASTER_POINTER = 1,
+	XCB_INPUT_DEVICE_TYPE_MASTER_KEYBOARD = 2,
+	XCB_INPUT_DEVICE_TYPE_SLAVE_POINTER = 3,
+	XCB_INPUT_DEVICE_TYPE_SLAVE_KEYBOARD = 4,
+	XCB_INPUT_DEVICE_TYPE_FLOATING_SLAVE = 5
+} xcb_input_device_type_t;
+
+typedef enum xcb_input_hierarchy_mask_t {
+	XCB_INPUT_HIERARCHY_MASK_MASTER_ADDED = 1 << 0,
+	XCB_INPUT_HIERARCHY_MASK_MASTER_REMOVED = 1 << 1,
+	XCB_INPUT_HIERARCHY_MASK_SLAVE_ADDED = 1 << 2,
+	XCB_INPUT_HIERARCHY_MASK_SLAVE_REMOVED = 1 << 3,
+	XCB_INPUT_HIERARCHY_MASK_SLAVE_ATTACHED = 1 << 4,
+	XCB_INPUT_HIERARCHY_MASK_SLAVE_DETACHED = 1 << 5,
+	XCB_INPUT_HIERARCHY_MASK_DEVICE_ENABLED = 1 << 6,
+	XCB_INPUT_HIERARCHY_MASK_DEVICE_DISABLED = 1 << 7
+} xcb_input_hierarchy_mask_t;
+
+/* Followed by mask_len words of mask */
+typedef struct xcb_input_event_mask_t {
+	xcb_input_device_id_t deviceid;
+	uint16_t mask_len;
+} xcb_input_event_mask_t;
+
+typedef struct xcb_input_hierarchy_info_t {
+	xcb_input_device_id_t deviceid;
+	xcb_input_device_id_t attachment;
+	uint8_t type;
+	uint8_t enabled;
+	uint8_t pad0[2];
+	uint32_t flags;
+} xcb_input_hierarchy_info_t;
+
+typedef struct xcb_input_hierarchy_info_iterator_t {
+	xcb_input_hierarchy_info_t *data;
+	int rem;
+	int index;
+} xcb_input_hierarchy_info_iterator_t;
+
+/* As xcb returns it: the infos follow full_sequence, not the first 32 bytes
+ * as on the wire. */
+typedef struct xcb_input_hierarchy_event_t {
+	uint8_t response_type;
+	uint8_t extension;
+	uint16_t sequence;
+	uint32_t length;
+	uint16_t event_type;
+	xcb_input_device_id_t deviceid;
+	xcb_timestamp_t time;
+	uint32_t flags;
+	uint16_t num_infos;
+	uint8_t pad0[10];
+	uint32_t full_sequence;
+} xcb_input_hierarchy_event_t;
+
+extern xcb_extension_t xcb_input_id;
+
+xcb_input_hierarchy_info_iterator_t xcb_input_hierarchy_infos_iterator(const xcb_input_hierarchy_event_t *R);
+void xcb_input_hierarchy_info_next(xcb_input_hierarchy_info_iterator_t *i);
+xcb_void_cookie_t xcb_input_xi_select_events(xcb_connection_t *c, xcb_window_t window, uint16_t num_mask,
+                                             const xcb_input_event_mask_t *masks);
+
+/* XKB */
+
+#define XCB_XKB_MAJOR_VERSION 1
+#define XCB_XKB_MINOR_VERSION 0
+
+#define XCB_XKB_USE_EXTENSION 0
+#define XCB_XKB_SELECT_EVENTS 1
+#define XCB_XKB_GET_CONTROLS 6
+#define XCB_XKB_SET_CONTROLS 7
+
+#define XCB_XKB_NEW_KEYBOARD_NOTIFY 0
+#define XCB_XKB_STATE_NOTIFY 2
+#define XCB_XKB_CONTROLS_NOTIFY 3
+
+typedef uint16_t xcb_xkb_device_spec_t;
+
+typedef enum xcb_xkb_id_t {
+	XCB_XKB_ID_USE_CORE_KBD = 256
+} xcb_xkb_id_t;
+
+typedef enum xcb_xkb_bool_ctrl_t {
+	XCB_XKB_BOOL_CTRL_REPEAT_KEYS = 1 << 0
+} xcb_xkb_bool_ctrl_t;
+
+typedef enum xcb_xkb_event_type_t {
+	XCB_XKB_EVENT_TYPE_NEW_KEYBOARD_NOTIFY = 1 << 0,
+	XCB_XKB_EVENT_TYPE_MAP_NOTIFY = 1 << 1,
+	XCB_XKB_EVENT_TYPE_STATE_NOTIFY = 1 << 2,
+	XCB_XKB_EVENT_TYPE_CONTROLS_NOTIFY = 1 << 3,
+	XCB_XKB_EVENT_TYPE_INDICATOR_STATE_NOTIFY = 1 << 4,
+	XCB_XKB_EVENT_TYPE_INDICATOR_MAP_NOTIFY = 1 << 5,
+	XCB_XKB_EVENT_TYPE_NAMES_NOTIFY = 1 << 6,
+	XCB_XKB_EVENT_TYPE_COMPAT_MAP_NOTIFY = 1 << 7,
+	XCB_XKB_EVENT_TYPE_BELL_NOTIFY = 1 << 8,
+	XCB_XKB_EVENT_TYPE_ACTION_MESSAGE = 1 << 9,
+	XCB_XKB_EVENT_TYPE_ACCESS_X_NOTIFY = 1 << 10,
+	XCB_XKB_EVENT_TYPE_EXTENSION_DEVICE_NOTIFY = 1 << 11
+} xcb_xkb_event_type_t;
+
+typedef enum xcb_xkb_nkn_detail_t {
+	XCB_XKB_NKN_DETAIL_KEYCODES = 1 << 0,
+	XCB_XKB_NKN_DETAIL_GEOMETRY = 1 << 1,
+	XCB_XKB_NKN_DETAIL_DEVICE_ID = 1 << 2
+} xcb_xkb_nkn_detail_t;
+
+typedef struct xcb_xkb_controls_notify_event_t {
+	uint8_t response_type;
+	uint8_t xkbType;
+	uint16_t sequence;
+	xcb_timestamp_t time;
+	uint8_t deviceID;
+	uint8_t numGroups;
+	uint8_t prevNumGroups;
+	uint8_t pad0;
+	uint32_t changedControls;
+	uint32_t enabledControls;
+	uint32_t enabledControlChanges;
+	uint8_t keycode;
+	uint8_t eventType;
+	uint8_t requestMajor;
+	uint8_t requestMinor;
+	uint8_t pad1[4];
+} xcb_xkb_controls_notify_event_t;
+
+typedef struct xcb_xkb_use_extension_cookie_t {
+	unsigned int sequence;
+} xcb_xkb_use_extension_cookie_t;
+
+typedef struct xcb_xkb_use_extension_reply_t {
+	uint8_t response_type;
+	uint8_t supported;
+	uint16_t sequence;
+	uint32_t length;
+	uint16_t serverMajor;
+	uint16_t serverMinor;
+	uint8_t pad0[20];
+} xcb_xkb_use_extension_reply_t;
+
+typedef struct xcb_xkb_get_controls_cookie_t {
+	unsigned int sequence;
+} xcb_xkb_get_controls_cookie_t;
+
+typedef struct xcb_xkb_get_controls_reply_t {
+	uint8_t response_type;
+	uint8_t deviceID;
+	uint16_t sequence;
+	uint32_t length;
+	uint8_t mouseKeysDfltBtn;
+	uint8_t numGroups;
+	uint8_t groupsWrap;
+	uint8_t internalModsMask;
+	uint8_t ignoreLockModsMask;
+	uint8_t internalModsRealMods;
+	uint8_t ignoreLockModsRealMods;
+	uint8_t pad0;
+	uint16_t internalModsVmods;
+	uint16_t ignoreLockModsVmods;
+	uint16_t repeatDelay;
+	uint16_t repeatInterval;
+	uint16_t slowKeysDelay;
+	uint16_t debounceDelay;
+	uint16_t mouseKeysDelay;
+	uint16_t mouseKeysInterval;
+	uint16_t mouseKeysTimeToMax;
+	uint16_t mouseKeysMaxSpeed;
+	int16_t mouseKeysCurve;
+	uint16_t accessXOption;
+	uint16_t accessXTimeout;
+	uint16_t accessXTimeoutOptionsMask;
+	uint16_t accessXTimeoutOptionsValues;
+	uint8_t pad1[2];
+	uint32_t accessXTimeoutMask;
+	uint32_t accessXTimeoutValues;
+	uint32_t enabledControls;
+	uint8_t perKeyRepeat[32];
+} xcb_xkb_get_controls_reply_t;
+
+typedef struct xcb_xkb_set_controls_request_t {
+	uint8_t major_opcode;
+	uint8_t minor_opcode;
+	uint16_t length;
+	xcb_xkb_device_spec_t deviceSpec;
+	uint8_t affectInternalRealMods;
+	uint8_t internalRealMods;
+	uint8_t affectIgnoreLockRealMods;
+	uint8_t ignoreLockRealMods;
+	uint16_t affectInternalVirtualMods;
+	uint16_t internalVirtualMods;
+	uint16_t affectIgnoreLockVirtualMods;
+	uint16_t ignoreLockVirtualMods;
+	uint8_t mouseKeysDfltBtn;
+	uint8_t groupsWrap;
+	uint16_t accessXOptions;
+	uint8_t pad0[2];
+	uint32_t affectEnabledControls;
+	uint32_t enabledControls;
+	uint32_t changeControls;
+	uint16_t repeatDelay;
+	uint16_t repeatInterval;
+	uint16_t slowKeysDelay;
+	uint16_t debounceDelay;
+	uint16_t mouseKeysDelay;
+	uint16_t mouseKeysInterval;
+	uint16_t mouseKeysTimeToMax;
+	uint16_t mouseKeysMaxSpeed;
+	int16_t mouseKeysCurve;
+	uint16_t accessXTimeout;
+	uint32_t accessXTimeoutMask;
+	uint32_t accessXTimeoutValues;
+	uint16_t accessXTimeoutOptionsMask;
+	uint16_t accessXTimeoutOptionsValues;
+	uint8_t perKeyRepeat[32];
+} xcb_xkb_set_controls_request_t;
+
+extern xcb_extension_t xcb_xkb_id;
+
+xcb_xkb_use_extension_cookie_t xcb_xkb_use_extension(xcb_connection_t *c, uint16_t wantedMajor, uint16_t wantedMinor);
+xcb_xkb_use_extension_reply_t *xcb_xkb_use_extension_reply(xcb_connection_t *c, xcb_xkb_use_extension_cookie_t cookie,
+                                                           xcb_generic_error_t **e);
+/* details is the list of the fields of the event types in affectWhich, and
+ * neither clear nor selectAll, as on the wire */
+xcb_void_cookie_t xcb_xkb_select_events(xcb_connection_t *c, xcb_xkb_device_spec_t deviceSpec, uint16_t affectWhich,
+                                        uint16_t clear, uint16_t selectAll, uint16_t affectMap, uint16_t map,
+                                        const void *details);
+xcb_xkb_get_controls_cookie_t xcb_xkb_get_controls(xcb_connection_t *c, xcb_xkb_device_spec_t deviceSpec);
+xcb_xkb_get_controls_reply_t *xcb_xkb_get_controls_reply(xcb_connection_t *c, xcb_xkb_get_controls_cookie_t cookie,
+                                                         xcb_generic_error_t **e);
+xcb_void_cookie_t xcb_xkb_set_controls_checked(xcb_connection_t *c, xcb_xkb_device_spec_t deviceSpec,
+                                               uint8_t affectInternalRealMods, uint8_t internalRealMods,
+                                               uint8_t affectIgnoreLockRealMods, uint8_t ignoreLockRealMods,
+                                               uint16_t affectInternalVirtualMods, uint16_t internalVirtualMods,
+                                               uint16_t affectIgnoreLockVirtualMods, uint16_t ignoreLockVirtualMods,
+                                               uint8_t mouseKeysDfltBtn, uint8_t groupsWrap, uint16_t accessXOptions,
+                                               uint32_t affectEnabledControls, uint32_t enabledControls,
+                                               uint32_t changeControls, uint16_t repeatDelay, uint16_t repeatInterval,
+                                               uint16_t slowKeysDelay, uint16_t debounceDelay,
+                                               uint16_t mouseKeysDelay, uint16_t mouseKeysInterval,
+                                               uint16_t mouseKeysTimeToMax, uint16_t mouseKeysMaxSpeed,
+                                               int16_t mouseKeysCurve, uint16_t accessXTimeout,
+                                               uint32_t accessXTimeoutMask, uint32_t accessXTimeoutValues,
+                                               uint16_t accessXTimeoutOptionsMask, uint16_t accessXTimeoutOptionsValues,
+                                               const uint8_t *perKeyRepeat);
+
+#endif /* MINIMAL */
+
+#endif /* XCBMIN_H */